@@ -0,0 +1,903 @@
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE // syscall
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+#endif
+
+#include "st.h"
+
+/*
+ * micro benchmarks over a file, usage: bench <filename> [benchmark...]
+ * with no benchmarks named, all of them are run
+ */
+
+static struct timespec before;
+
+static void start(void)
+{
+	clock_gettime(CLOCK_REALTIME, &before);
+}
+
+static double stop(void)
+{
+	struct timespec after;
+	clock_gettime(CLOCK_REALTIME, &after);
+	return (after.tv_nsec - before.tv_nsec) / 1000000.0f +
+		(after.tv_sec - before.tv_sec) * 1000;
+}
+
+// scatters small replacements over the table, like main.c, so that it is
+// made up of many slices rather than a single large one
+static void fragment(SliceTable *st)
+{
+	for(size_t n = 34; n + 5 < st_size(st); n += 59*16) {
+		st_delete(st, n, 5);
+		st_insert(st, n, "thang", 5);
+	}
+}
+
+/* loading */
+
+static void bench_load(const char *path)
+{
+	start();
+	SliceTable *st = st_new_from_file(path);
+	printf("from_file: loaded %zu bytes in %f ms\n", st_size(st), stop());
+
+	size_t len = st_size(st);
+	char *data = malloc(len);
+	FILE *file = fopen(path, "r");
+	len = fread(data, 1, len, file);
+	fclose(file);
+	st_free(st);
+
+	// slice by slice, as before
+	start();
+	st = st_new();
+	for(size_t pos = 0; pos < len; pos += 1<<15)
+		st_insert(st, pos, data + pos, MIN(len - pos, 1<<15));
+	printf("insert: loaded %zu bytes in %f ms\n", st_size(st), stop());
+	st_free(st);
+
+	start();
+	st = st_new_from_buffer(data, len, 1);
+	printf("from_buffer, 1 thread: loaded %zu bytes in %f ms\n",
+			st_size(st), stop());
+	st_free(st);
+
+	start();
+	st = st_new_from_buffer(data, len, 0);
+	printf("from_buffer, all cpus: loaded %zu bytes in %f ms\n",
+			st_size(st), stop());
+	st_free(st);
+
+	free(data);
+}
+
+/* lines */
+
+static void bench_lines(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	SliceIter *it = st_iter_new(st, 0);
+	size_t lines = 0, size = st_size(st);
+
+	start();
+	while(st_iter_pos(it) < size)
+		if(st_iter_next_byte(it, 1) == '\n')
+			lines++;
+	printf("next_byte: %zu lines in %f ms\n", lines, stop());
+
+	lines = 0;
+	st_iter_to(it, 0);
+	start();
+	while(st_iter_next_line(it, 1))
+		lines++;
+	printf("next_line: %zu lines in %f ms\n", lines, stop());
+
+	lines = 0;
+	start();
+	while(st_iter_prev_line(it, 1))
+		lines++;
+	printf("prev_line: %zu lines in %f ms\n", lines, stop());
+
+	st_iter_free(it);
+	st_free(st);
+}
+
+/* seeking */
+
+static void bench_seek(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	SliceIter *it = st_iter_new(st, 0);
+	size_t size = st_size(st), sum = 0;
+
+	srand(0);
+	start();
+	for(int i = 0; i < 1000000; i++) {
+		st_iter_to(it, rand() % size);
+		sum += st_iter_byte(it);
+	}
+	printf("iter_to: 1000000 random seeks in %f ms (%zu)\n", stop(), sum);
+
+	sum = 0;
+	start();
+	for(int i = 0; i < 1000000; i++)
+		sum += st_pos_to_line(st, rand() % size);
+	printf("pos_to_line: 1000000 random lookups in %f ms (%zu)\n", stop(),
+			sum);
+
+	// cursor movement: mostly within a few KiB, sometimes anywhere
+	size_t *targets = malloc(1000000 * sizeof *targets), pos = size / 2;
+	for(int i = 0; i < 1000000; i++) {
+		if(rand() % 16) {
+			size_t step = rand() % 8192;
+			pos = MIN(size - 1, pos + step - MIN(pos, 4096));
+		} else
+			pos = rand() % size;
+		targets[i] = pos;
+	}
+	sum = 0;
+	st_iter_to(it, size / 2);
+	start();
+	for(int i = 0; i < 1000000; i++) {
+		st_iter_to(it, targets[i]);
+		sum += st_iter_byte(it);
+	}
+	printf("iter_to: 1000000 local seeks in %f ms (%zu)\n", stop(), sum);
+
+	sum = 0;
+	st_iter_to(it, size / 2);
+	start();
+	for(int i = 0; i < 1000000; i++) {
+		st_iter_seek_rel(it, (long)(targets[i] - st_iter_pos(it)));
+		sum += st_iter_byte(it);
+	}
+	printf("seek_rel: 1000000 local seeks in %f ms (%zu)\n", stop(), sum);
+	free(targets);
+
+	st_iter_free(it);
+	st_free(st);
+}
+
+// an iterator kept on a view while edits are made elsewhere, brought up to
+// date after each by searching again or by refreshing it, against the edits
+// alone
+static void bench_refresh(const char *path)
+{
+	static const char *modes[] = {
+		"edits alone", "st_iter_to", "st_iter_refresh"
+	};
+	for(int mode = 0; mode < 3; mode++) {
+		SliceTable *st = st_new_from_file(path);
+		fragment(st);
+		size_t view = st_size(st) / 2, sum = 0;
+		SliceIter *it = st_iter_new(st, view);
+		srand(0);
+		start();
+		for(int i = 0; i < 100000; i++) {
+			size_t pos = rand() % st_size(st);
+			if(i % 2 == 0) {
+				st_insert(st, pos, "thang", 5);
+				view += pos <= view ? 5 : 0;
+			} else {
+				pos = MIN(pos, st_size(st) - 5);
+				st_delete(st, pos, 5);
+				view = view >= pos + 5 ? view - 5 : MIN(view, pos);
+			}
+			if(mode == 1)
+				st_iter_to(it, view);
+			else if(mode == 2)
+				st_iter_refresh(it);
+			if(mode)
+				sum += st_iter_byte(it);
+		}
+		printf("%s: 100000 edits in %f ms (%zu)\n", modes[mode], stop(), sum);
+		st_iter_free(it);
+		st_free(st);
+	}
+}
+
+/* marks */
+
+// small edits with many marks, kept in an array and moved by hand, or as marks
+static void bench_marks(const char *path)
+{
+	enum { NMARKS = 10000 };
+	static size_t naive[NMARKS];
+	static SliceMark *marks[NMARKS];
+	for(int mode = 0; mode < 2; mode++) {
+		SliceTable *st = st_new_from_file(path);
+		fragment(st);
+		srand(0);
+		for(int i = 0; i < NMARKS; i++) {
+			size_t pos = rand() % st_size(st);
+			if(mode == 0)
+				naive[i] = pos;
+			else
+				marks[i] = st_mark_new(st, pos, 0);
+		}
+		size_t sum = 0;
+		start();
+		for(int i = 0; i < 100000; i++) {
+			size_t pos = rand() % (st_size(st) - 5);
+			if(i % 2 == 0) {
+				st_insert(st, pos, "thang", 5);
+				for(int j = 0; mode == 0 && j < NMARKS; j++)
+					naive[j] += naive[j] > pos ? 5 : 0;
+			} else {
+				st_delete(st, pos, 5);
+				for(int j = 0; mode == 0 && j < NMARKS; j++)
+					naive[j] = naive[j] >= pos + 5 ? naive[j] - 5 :
+						MIN(naive[j], pos);
+			}
+			// where the cursor is
+			sum += mode ? st_mark_pos(marks[i % NMARKS]) : naive[i % NMARKS];
+		}
+		printf("%s: 100000 edits with %d marks in %f ms (%zu)\n",
+			mode ? "st_mark" : "array", NMARKS, stop(), sum);
+		st_free(st);
+	}
+}
+
+/* search */
+
+// counts the occurrences that don't overlap, as st_find_all does
+static size_t memmem_all(const char *data, size_t len,
+						const char *needle, size_t nlen)
+{
+	size_t count = 0;
+	const char *end = data + len;
+	for(const char *m = data; (m = memmem(m, end - m, needle, nlen));
+			m += nlen)
+		count++;
+	return count;
+}
+
+static void bench_find(const char *path)
+{
+	SliceTable *flat = st_new_from_file(path), *st = st_new_from_file(path);
+	fragment(st);
+	// the same text in one buffer, for memmem
+	size_t size = st_size(st), n = 0, len;
+	char *data = malloc(size);
+	SliceIter *it = st_iter_new(st, 0);
+	do {
+		char *chunk = st_iter_chunk(it, &len);
+		memcpy(data + n, chunk, len);
+		n += len;
+	} while(st_iter_next_chunk(it));
+	st_iter_free(it);
+
+	size_t nlens[] = { 4, 16, 64 };
+	for(int i = 0; i < 3 && nlens[i] < size; i++) {
+		const char *needle = data + size / (i + 2);
+		size_t nlen = nlens[i], count, *found;
+		printf("needle of %zu bytes\n", nlen);
+		start();
+		count = memmem_all(data, size, needle, nlen);
+		printf("  memmem: %zu matches in %f ms\n", count, stop());
+		start();
+		count = st_find_all(st, needle, nlen, &found);
+		printf("  st_find_all: %zu matches in %f ms\n", count, stop());
+		free(found);
+		start();
+		count = st_find_all(flat, needle, nlen, &found);
+		printf("  st_find_all, unfragmented: %zu matches in %f ms\n", count,
+			stop());
+		free(found);
+		start();
+		count = 0;
+		for(size_t pos = 0; st_find(st, pos, needle, nlen, &pos); pos += nlen)
+			count++;
+		printf("  st_find: %zu matches in %f ms\n", count, stop());
+	}
+	free(data);
+	st_free(flat);
+	st_free(st);
+}
+
+/* cache misses */
+
+#ifdef __linux__
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} events[] = {
+	{ "cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "l1d read misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		PERF_COUNT_HW_CACHE_OP_READ << 8 |
+		PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+#define NEVENTS (sizeof events / sizeof *events)
+static int counters[NEVENTS];
+
+// counts events in this thread, where the kernel and hardware allow it
+static void start_counters(void)
+{
+	for(size_t i = 0; i < NEVENTS; i++) {
+		struct perf_event_attr attr = {
+			.size = sizeof attr,
+			.type = events[i].type,
+			.config = events[i].config,
+			.exclude_kernel = 1,
+			.exclude_hv = 1,
+		};
+		counters[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+static void print_counters(void)
+{
+	for(size_t i = 0; i < NEVENTS; i++) {
+		uint64_t count;
+		if(counters[i] < 0 ||
+				read(counters[i], &count, sizeof count) != sizeof count)
+			printf("  %s: unavailable\n", events[i].name);
+		else
+			printf("  %s: %lu\n", events[i].name, (unsigned long)count);
+		if(counters[i] >= 0)
+			close(counters[i]);
+	}
+}
+#else
+static void start_counters(void) {}
+static void print_counters(void) { printf("  counters unavailable\n"); }
+#endif
+
+// the seeks and scans that walk the tree, with the cache misses they cause.
+// Small slices are merged up to HIGH_WATER, so the tree only outgrows the
+// cache for large files or when built with a small HIGH_WATER
+static void bench_cache(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	SliceIter *it = st_iter_new(st, 0);
+	size_t size = st_size(st), sum = 0;
+	printf("%zu leaves\n", st_node_count(st));
+
+	srand(0);
+	start_counters();
+	start();
+	for(int i = 0; i < 1000000; i++) {
+		st_iter_to(it, rand() % size);
+		sum += st_iter_byte(it);
+	}
+	printf("iter_to: 1000000 random seeks in %f ms (%zu)\n", stop(), sum);
+	print_counters();
+
+	size_t len, chunks = 0;
+	st_iter_to(it, 0);
+	start_counters();
+	start();
+	do {
+		st_iter_chunk(it, &len);
+		chunks++;
+	} while(st_iter_next_chunk(it));
+	printf("next_chunk: %zu chunks in %f ms\n", chunks, stop());
+	print_counters();
+
+	st_iter_free(it);
+	st_free(st);
+}
+
+// chunk by chunk scans of deep trees, made by concatenating a table with
+// itself, which shares its nodes rather than copying them
+static void bench_scan(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	for(int depth = 4; depth <= 6; depth++) {
+		while(st_depth(st) < depth) {
+			SliceTable *twice = st_concat(st, st);
+			st_free(st);
+			st = twice;
+		}
+		SliceIter *it = st_iter_new(st, 0);
+		size_t len, chunks = 0;
+		start();
+		do {
+			st_iter_chunk(it, &len);
+			chunks++;
+		} while(st_iter_next_chunk(it));
+		printf("depth %d: %zu chunks forward in %f ms\n", depth, chunks,
+				stop());
+
+		st_iter_to(it, st_size(st) - 1);
+		start();
+		while(st_iter_prev_chunk(it))
+			;
+		printf("depth %d: %zu chunks backward in %f ms\n", depth, chunks,
+				stop());
+		st_iter_free(it);
+	}
+	st_free(st);
+}
+
+/* codepoints */
+
+static void bench_codepoints(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	SliceIter *it = st_iter_new(st, 0);
+	size_t cps = 0, size = st_size(st);
+
+	start();
+	while(st_iter_pos(it) < size) {
+		char c = st_iter_byte(it);
+		cps += (c & 0xC0) != 0x80;
+		st_iter_next_byte(it, 1);
+	}
+	printf("next_byte: %zu codepoints in %f ms\n", cps, stop());
+
+	cps = 0;
+	st_iter_to(it, 0);
+	start();
+	while(st_iter_pos(it) < size) {
+		st_iter_next_cp(it, 1);
+		cps++;
+	}
+	printf("next_cp: %zu codepoints in %f ms\n", cps, stop());
+
+	size_t total = st_codepoints(st), sum = 0;
+	srand(0);
+	start();
+	for(int i = 0; i < 100000; i++)
+		sum += st_cp_to_byte(st, rand() % total);
+	printf("cp_to_byte: 100000 random lookups in %f ms (%zu)\n", stop(), sum);
+
+	st_iter_free(it);
+	st_free(st);
+}
+
+/* edits */
+
+// random small edits, each a descent to a leaf and the copies on the way
+static void bench_edit(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+
+	srand(0);
+	start();
+	for(int i = 0; i < 100000; i++)
+		st_insert(st, rand() % st_size(st), "thang", 5);
+	printf("insert: 100000 random inserts in %f ms\n", stop());
+
+	start();
+	for(int i = 0; i < 100000; i++)
+		st_delete(st, rand() % (st_size(st) - 5), 5);
+	printf("delete: 100000 random deletes in %f ms\n", stop());
+
+	st_free(st);
+}
+
+/* range deletion */
+
+static void bench_delete(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	size_t from = st_size(st) / 4, len = st_size(st) / 2;
+
+	// about one descent per leaf, as when deletion went leaf by leaf
+	SliceTable *clone = st_clone(st);
+	start();
+	for(size_t left = len; left > 0; left -= MIN(left, 1<<16))
+		st_delete(clone, from, MIN(left, 1<<16));
+	printf("64KiB steps: deleted %zu bytes in %f ms\n", len, stop());
+	st_free(clone);
+
+	clone = st_clone(st);
+	start();
+	st_delete(clone, from, len);
+	printf("single call: deleted %zu bytes in %f ms\n", len, stop());
+	st_free(clone);
+
+	st_free(st);
+}
+
+/* copy on write */
+
+static void bench_clone(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	size_t size = st_size(st);
+
+	// each edit copies the path to a leaf shared with st
+	SliceTable *clone = st_clone(st);
+	srand(0);
+	start();
+	for(int i = 0; i < 10000; i++)
+		st_insert(clone, rand() % size, "x", 1);
+	printf("clone: 10000 scattered inserts in %f ms\n", stop());
+	st_free(clone);
+
+	start();
+	for(int i = 0; i < 10000; i++) {
+		clone = st_clone(st);
+		st_insert(clone, rand() % size, "x", 1);
+		st_free(clone);
+	}
+	printf("clone: 10000 clones edited once in %f ms\n", stop());
+
+	st_free(st);
+}
+
+/* history */
+
+static void bench_undo(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	st_set_history(st, (size_t)1 << 30);
+	size_t from = st_size(st) / 4, len = st_size(st) / 2;
+
+	start();
+	st_delete(st, from, len);
+	printf("delete: deleted %zu bytes in %f ms\n", len, stop());
+
+	start();
+	st_undo(st);
+	printf("undo: restored %zu bytes in %f ms\n", st_size(st), stop());
+
+	start();
+	for(int i = 0; i < 10000; i++)
+		st_insert(st, from + i, "x", 1);
+	printf("typing: 10000 inserts in %f ms\n", stop());
+
+	start();
+	int undos = 0;
+	while(st_undo(st))
+		undos++;
+	printf("undo: %d groups in %f ms\n", undos, stop());
+
+	st_free(st);
+}
+
+/* batched edits */
+
+static void bench_batch(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	size_t n = 0, size = st_size(st);
+	SliceEdit *edits = malloc((size / 59 + 1) * sizeof *edits);
+	for(size_t pos = 34; pos + 5 <= size; pos += 59)
+		edits[n++] = (SliceEdit){
+			.pos = pos, .del = 5, .data = "thang", .len = 5
+		};
+
+	SliceTable *clone = st_clone(st);
+	start();
+	for(size_t i = 0; i < n; i++) {
+		st_delete(clone, edits[i].pos, edits[i].del);
+		st_insert(clone, edits[i].pos, edits[i].data, edits[i].len);
+	}
+	printf("delete+insert: %zu replacements in %f ms\n", n, stop());
+	st_free(clone);
+
+	clone = st_clone(st);
+	start();
+	st_apply_batch(clone, edits, n);
+	printf("apply_batch: %zu replacements in %f ms\n", n, stop());
+	st_free(clone);
+
+	free(edits);
+	st_free(st);
+}
+
+/* transient editing */
+
+static void bench_transient(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	size_t from = st_size(st) / 4, size = st_size(st);
+
+	for(int transient = 0; transient < 2; transient++) {
+		SliceTable *clone = st_clone(st);
+		if(transient)
+			st_transient(clone);
+		start();
+		for(int i = 0; i < 100000; i++)
+			st_insert(clone, from + i, "x", 1);
+		printf("%s: 100000 inserts in %f ms\n",
+				transient ? "transient" : "persistent", stop());
+		st_persist(clone);
+		st_free(clone);
+	}
+
+	for(int transient = 0; transient < 2; transient++) {
+		SliceTable *clone = st_clone(st);
+		if(transient)
+			st_transient(clone);
+		size_t n = 0;
+		start();
+		for(size_t pos = 34; pos + 5 <= size; pos += 59, n++) {
+			st_delete(clone, pos, 5);
+			st_insert(clone, pos, "thang", 5);
+		}
+		printf("%s: %zu replacements in %f ms\n",
+				transient ? "transient" : "persistent", n, stop());
+		st_persist(clone);
+		st_free(clone);
+	}
+
+	st_free(st);
+}
+
+/* split and concatenation */
+
+static void bench_split(const char *path)
+{
+	SliceTable *st = st_new_from_file(path), *left, *right;
+	fragment(st);
+	size_t pos = st_size(st) / 3;
+
+	start();
+	st_split(st, pos, &left, &right);
+	printf("split: split %zu bytes in %f ms\n", st_size(st), stop());
+
+	// moving the first third to the end, the old way
+	SliceTable *clone = st_clone(right);
+	start();
+	SliceIter *it = st_iter_new(left, 0);
+	do {
+		size_t len;
+		char *data = st_iter_chunk(it, &len);
+		st_insert(clone, st_size(clone), data, len);
+	} while(st_iter_next_chunk(it) && st_iter_pos(it) < pos);
+	printf("insert: joined %zu bytes in %f ms\n", st_size(clone), stop());
+	st_iter_free(it);
+	st_free(clone);
+
+	start();
+	clone = st_concat(right, left);
+	printf("concat: joined %zu bytes in %f ms\n", st_size(clone), stop());
+	st_free(clone);
+
+	st_free(left);
+	st_free(right);
+	st_free(st);
+}
+
+/* range copies */
+
+static void bench_copy(const char *path)
+{
+	SliceTable *src = st_new_from_file(path), *dst = st_new();
+	fragment(src);
+	size_t from = st_size(src) / 4, len = st_size(src) / 2;
+
+	// start at a slice boundary, as chunks are whole slices
+	SliceIter *it = st_iter_new(src, from);
+	st_iter_next_chunk(it);
+	from = st_iter_pos(it);
+	start();
+	for(size_t left = len; left > 0; st_iter_next_chunk(it)) {
+		size_t n;
+		char *data = st_iter_chunk(it, &n);
+		n = MIN(n, left);
+		st_insert(dst, st_size(dst), data, n);
+		left -= n;
+	}
+	printf("insert: copied %zu bytes in %f ms\n", st_size(dst), stop());
+	st_iter_free(it);
+	st_free(dst);
+
+	dst = st_new();
+	start();
+	st_insert_from(dst, 0, src, from, len);
+	printf("insert_from: copied %zu bytes in %f ms\n", st_size(dst), stop());
+	st_free(dst);
+
+	st_free(src);
+}
+
+/* memory */
+
+// resident set size in KiB
+static size_t rss(void)
+{
+	size_t pages = 0;
+	FILE *file = fopen("/proc/self/statm", "r");
+	if(file) {
+		if(fscanf(file, "%*u %zu", &pages) != 1)
+			pages = 0;
+		fclose(file);
+	}
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void bench_memory(const char *path)
+{
+	size_t before = rss();
+	SliceTable *st = st_new_from_file(path);
+	SliceTable *clone = st_clone(st);
+	size_t loaded = rss();
+
+	// the replacements of main.c, as many as fit
+	int n = 0;
+	start();
+	for(size_t pos = 34; n < 100000 && pos + 5 < st_size(st); pos += 59, n++) {
+		st_delete(st, pos, 5);
+		st_insert(st, pos, "thang", 5);
+	}
+	printf("%d replacements in %f ms\n", n, stop());
+	printf("rss: %zu KiB loaded, %zu KiB after editing, %zu leaves\n",
+			loaded - before, rss() - before, st_node_count(st));
+	st_free(clone);
+	st_free(st);
+
+	// scattered small inserts between large slices, each a slice of its own
+	before = rss();
+	st = st_new_from_file(path);
+	loaded = rss();
+	srand(0);
+	start();
+	for(int i = 0; i < 20000; i++)
+		st_insert(st, rand() % st_size(st), "x", 1);
+	printf("20000 scattered inserts in %f ms\n", stop());
+	printf("rss: %zu KiB loaded, %zu KiB after editing, %zu leaves\n",
+			loaded - before, rss() - before, st_node_count(st));
+	st_free(st);
+}
+
+/* saving */
+
+static void bench_save(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	// fewer edits than fragment(), leaving long runs of the mapped file
+	for(size_t n = 34; n + 5 < st_size(st); n += 59*1000) {
+		st_delete(st, n, 5);
+		st_insert(st, n, "thang", 5);
+	}
+
+	// through stdio, copying every byte
+	FILE *file = tmpfile();
+	start();
+	st_dump(st, file);
+	fflush(file);
+	printf("dump: wrote %zu bytes in %f ms\n", st_size(st), stop());
+	fclose(file);
+
+	file = tmpfile();
+	start();
+	st_write_fd(st, fileno(file));
+	printf("write_fd: wrote %zu bytes in %f ms\n", st_size(st), stop());
+	fclose(file);
+
+	st_free(st);
+}
+
+/* parallel traversal */
+
+static void count_newlines(const char *data, size_t len, size_t pos,
+						void *acc)
+{
+	(void)pos;
+	size_t *lines = acc;
+	for(const char *end = data + len; (data = memchr(data, '\n', end - data));
+			data++)
+		++*lines;
+}
+
+static void add_counts(void *result, const void *acc)
+{
+	*(size_t *)result += *(const size_t *)acc;
+}
+
+static void count_bytes(const char *data, size_t len, size_t pos, void *acc)
+{
+	(void)pos;
+	size_t *counts = acc;
+	for(size_t i = 0; i < len; i++)
+		counts[(unsigned char)data[i]]++;
+}
+
+static void add_histograms(void *result, const void *acc)
+{
+	for(int i = 0; i < 256; i++)
+		((size_t *)result)[i] += ((const size_t *)acc)[i];
+}
+
+static void bench_parallel(const char *path)
+{
+	SliceTable *st = st_new_from_file(path);
+	fragment(st);
+	SliceIter *it = st_iter_new(st, 0);
+
+	size_t lines = 0;
+	start();
+	do {
+		size_t len;
+		char *data = st_iter_chunk(it, &len);
+		count_newlines(data, len, 0, &lines);
+	} while(st_iter_next_chunk(it));
+	printf("iterator: %zu lines in %f ms\n", lines, stop());
+	st_iter_free(it);
+
+	for(int threads = 1; threads <= 8; threads *= 2) {
+		lines = 0;
+		start();
+		st_parallel_reduce(st, threads, count_newlines, add_counts, &lines,
+							sizeof lines);
+		printf("reduce, %d threads: %zu lines in %f ms\n", threads, lines,
+				stop());
+	}
+
+	for(int threads = 1; threads <= 8; threads *= 2) {
+		size_t counts[256] = { 0 };
+		start();
+		st_parallel_reduce(st, threads, count_bytes, add_histograms, counts,
+							sizeof counts);
+		printf("reduce, %d threads: byte histogram in %f ms ('a': %zu)\n",
+				threads, stop(), counts['a']);
+	}
+
+	st_free(st);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(const char *path);
+} benchmarks[] = {
+	{ "load", bench_load },
+	{ "lines", bench_lines },
+	{ "seek", bench_seek },
+	{ "refresh", bench_refresh },
+	{ "marks", bench_marks },
+	{ "find", bench_find },
+	{ "cache", bench_cache },
+	{ "scan", bench_scan },
+	{ "codepoints", bench_codepoints },
+	{ "edit", bench_edit },
+	{ "delete", bench_delete },
+	{ "batch", bench_batch },
+	{ "clone", bench_clone },
+	{ "undo", bench_undo },
+	{ "transient", bench_transient },
+	{ "split", bench_split },
+	{ "copy", bench_copy },
+	{ "memory", bench_memory },
+	{ "save", bench_save },
+	{ "parallel", bench_parallel },
+};
+
+#define NBENCH (sizeof benchmarks / sizeof *benchmarks)
+
+int main(int argc, char **argv)
+{
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s <filename> [benchmark...]\n", argv[0]);
+		return 1;
+	}
+	st_print_struct_sizes();
+	for(size_t i = 0; i < NBENCH; i++) {
+		bool selected = argc == 2;
+		for(int j = 2; j < argc; j++)
+			selected |= !strcmp(argv[j], benchmarks[i].name);
+		if(selected) {
+			printf("\e[1m%s\e[0m\n", benchmarks[i].name);
+			benchmarks[i].run(argv[1]);
+		}
+	}
+}
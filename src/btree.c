@@ -2,26 +2,44 @@
  * persistent b+tree slice sequence
  */
 
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE // copy_file_range
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#ifdef __unix__
+#if defined(__unix__) || defined(__APPLE__) // macOS does not define __unix__
 	#include <fcntl.h>
 	#include <unistd.h>
+	#include <pthread.h>
 	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/uio.h>
 #else
 	#error TODO mmap for non-unix systems
 #endif
+#ifdef __linux__ // in-kernel copies for st_save, see flush_range
+	#include <sys/sendfile.h>
+#endif
 
 #include "st.h"
 
-#define HIGH_WATER (1<<15)
+// slices up to this size are small: copied, owned by their leaf and merged
+// with their neighbours. Set with -DHIGH_WATER, see the sweep target
+#ifndef HIGH_WATER
+	#define HIGH_WATER (1<<15)
+#endif
 #define LOW_WATER (HIGH_WATER/2)
+// large files are mapped in windows of this size, each a slice of its own
+#define WINDOW ((size_t)64 << 20)
 
 #if __x86_64__
 	#define USETAGS
@@ -33,33 +51,96 @@ struct block {
 	atomic_int refc;
 	// packed with int above. LARGE_MMAP indicates file mmap
 	enum blktype type;
-	// owned by the block, which lives as long as the slicetable, same as the
-	// leaves that immutably point into it. So this is safe, but how in rust?
+	// MMAP blocks keep their own descriptor of the file open, for copying
+	// ranges in the kernel
+	int fd;
+	// file offset of the window mapped by a MMAP block
+	off_t offset;
+	// owned by the block, which lives as long as the slicetable, same as
+	// the leaves that immutably point into it. So this is safe, but how
+	// in rust?
 	char *data;
 	// length of the block, used for mmap
 	size_t len;
-	// singly linked list for freeing later
-	struct block *next;
 };
 
-#define NODESIZE (256 - sizeof(atomic_int)) // close enough
-#define PER_B (sizeof(size_t) + sizeof(void *))
-#define B ((int)(NODESIZE / PER_B))
-struct node {
+// the blocks that a table's slices may point into, each referenced once.
+// Tables and their versions share sets, which are copied before adding to
+// one that is shared
+struct blockset {
 	atomic_int refc;
-	// TODO we could pack a int size field here. Is it worth it?
+	int n, cap;
+	struct block **blocks; // ordered by address, for merging sets
+};
+
+// text metrics maintained for each slot alongside its span
+struct metrics {
+	size_t lines; // number of '\n' bytes
+	size_t cps; // number of utf-8 codepoints, i.e. non-continuation bytes
+};
+
+// nodes are allocated on cache line boundaries and fill a whole number of
+// lines, so that a search touches as few of them as possible
+#define CACHE_LINE 64
+// bytes per node, setting the fanout B. Override with -DNODESIZE=n
+#ifndef NODESIZE
+	#define NODESIZE 640
+#endif
+#define NODE_HEADER 16
+#define PER_B (2 * sizeof(size_t) + sizeof(struct metrics) + sizeof(void *))
+#define B ((int)((NODESIZE - NODE_HEADER) / PER_B))
+struct node {
+	_Alignas(CACHE_LINE) atomic_int refc;
+	// token of the transient session that created or last copied this node
+	unsigned owner;
+	// position in the list of nodes edited on this thread, from 1
+	int dirty;
+	// number of live slots, brought up to date with ends. Edits read it
+	// while they haven't changed the node, and count with node_fill after
+	int fill;
+	// prefix sums of spans for searching, brought up to date after each edit.
+	// These come first as they are read on every step down the tree
+	size_t ends[B];
 	size_t spans[B];
+	struct metrics metrics[B];
 	void *child[B]; // in leaves (level 1), these are data pointers
 };
+_Static_assert(sizeof(struct node) == NODESIZE,
+			"NODESIZE must be a multiple of CACHE_LINE");
+// leaves and inner nodes share B. A leaf split keeps B/2 + 1 slots on the
+// left, which the old fill only covers from 4 slots up
+_Static_assert(B >= 4, "NODESIZE is too small");
+_Static_assert(offsetof(struct node, ends) == NODE_HEADER, "header is off");
 
 struct slicetable {
 	// tree root
 	struct node *root;
-	// singly linked list of blocks
-	struct block *blocks;
+	// the blocks it points into, or NULL if none
+	struct blockset *blocks;
 	// used for recursion. we could tag pointers instead, but that's a hack
 	// and we need to track blocks anyways
 	int levels;
+	// undo and redo, if enabled
+	struct history *history;
+	// token of the current transient session, or 0
+	unsigned owner;
+	// counts edits, so that iterators can tell whether they are current
+	unsigned long version;
+	// the last edit, or NULL before the first
+	struct lastedit *last;
+	// treap of marks, and a list of those detached by deletes
+	struct slicemark *marks, *detached;
+};
+
+// what an edit did, for iterators made just before it to catch up
+struct lastedit {
+	// false for edits other than a single insert or delete
+	bool known;
+	size_t pos, del, len;
+	// nodes that it changed, dropped or freed. Other leaves are where they
+	// were, with the same contents
+	const struct node **nodes;
+	size_t n, cap;
 };
 
 /* blocks */
@@ -67,22 +148,128 @@ struct slicetable {
 static void free_block(struct block *block)
 {
 	switch(block->type) {
-		case MMAP: munmap(block->data, block->len); break;
-		case HEAP: free(block->data);
+		case MMAP:
+			munmap(block->data, block->len);
+			close(block->fd);
+			break;
+		case HEAP: free(block->data); break;
 	}
 	free(block);
 }
 
+static bool within_block(const struct block *block, const char *data)
+{
+	return data >= block->data && data < block->data + block->len;
+}
+
 static void drop_block(struct block *block)
 {
 	if(atomic_fetch_sub_explicit(&block->refc,1,memory_order_release) == 1) {
 		atomic_thread_fence(memory_order_acquire);
-		if(block->next)
-			drop_block(block->next);
 		free_block(block);
 	}
 }
 
+static struct block *new_block(enum blktype type, char *data, size_t len)
+{
+	struct block *block = malloc(sizeof *block);
+	*block = (struct block){ .type = type, .data = data, .len = len };
+	atomic_store_explicit(&block->refc, 1, memory_order_relaxed);
+	return block;
+}
+
+static struct blockset *new_blockset(int cap)
+{
+	struct blockset *set = malloc(sizeof *set);
+	*set = (struct blockset){
+		.cap = cap, .blocks = malloc(cap * sizeof *set->blocks)
+	};
+	atomic_store_explicit(&set->refc, 1, memory_order_relaxed);
+	return set;
+}
+
+static struct blockset *share_blocks(struct blockset *set)
+{
+	if(set)
+		atomic_fetch_add_explicit(&set->refc, 1, memory_order_relaxed);
+	return set;
+}
+
+static void drop_blocks(struct blockset *set)
+{
+	if(!set ||
+			atomic_fetch_sub_explicit(&set->refc,1,memory_order_release) > 1)
+		return;
+	atomic_thread_fence(memory_order_acquire);
+	for(int i = 0; i < set->n; i++)
+		drop_block(set->blocks[i]);
+	free(set->blocks);
+	free(set);
+}
+
+// returns the union of a and b, either of which may be NULL, sharing one of
+// them when it holds all of the other's blocks
+static struct blockset *merge_blocks(struct blockset *a, struct blockset *b)
+{
+	if(!a || !b || a == b)
+		return share_blocks(a ? a : b);
+	struct blockset *set = new_blockset(a->n + b->n);
+	int i = 0, j = 0;
+	while(i < a->n || j < b->n) {
+		struct block *block;
+		if(j == b->n || i < a->n && a->blocks[i] < b->blocks[j])
+			block = a->blocks[i++];
+		else {
+			if(i < a->n && a->blocks[i] == b->blocks[j])
+				i++;
+			block = b->blocks[j++];
+		}
+		atomic_fetch_add_explicit(&block->refc, 1, memory_order_relaxed);
+		set->blocks[set->n++] = block;
+	}
+	if(set->n == a->n || set->n == b->n) {
+		struct blockset *whole = set->n == a->n ? a : b;
+		drop_blocks(set);
+		return share_blocks(whole);
+	}
+	return set;
+}
+
+// adds a new block to st, taking over the reference to it
+static void add_block(SliceTable *st, struct block *block)
+{
+	struct blockset *set = st->blocks;
+	if(!set || atomic_load_explicit(&set->refc, memory_order_acquire) > 1) {
+		set = new_blockset(set ? set->n + 1 : 1);
+		if(st->blocks) {
+			for(int i = 0; i < st->blocks->n; i++) {
+				set->blocks[i] = st->blocks->blocks[i];
+				atomic_fetch_add_explicit(&set->blocks[i]->refc, 1,
+										memory_order_relaxed);
+			}
+			set->n = st->blocks->n;
+			drop_blocks(st->blocks);
+		}
+		st->blocks = set;
+	}
+	if(set->n == set->cap) {
+		set->cap *= 2;
+		set->blocks = realloc(set->blocks, set->cap * sizeof *set->blocks);
+	}
+	int i = set->n;
+	for(; i > 0 && set->blocks[i-1] > block; i--)
+		set->blocks[i] = set->blocks[i-1];
+	set->blocks[i] = block;
+	set->n++;
+}
+
+static void walk_blocks(const struct blockset *set,
+		void (*fn)(const struct block *block, void *ctx), void *ctx)
+{
+	for(int i = 0; set && i < set->n; i++)
+		fn(set->blocks[i], ctx);
+}
+
 static void block_insert(char *block, size_t blocklen, size_t off,
 						const char *data, size_t len)
 {
@@ -95,6 +282,276 @@ static void block_delete(char *block, size_t blocklen, size_t off, size_t len)
 	memmove(block + off, block + off + len, blocklen - off - len);
 }
 
+/* pools */
+
+// freed nodes and small slice buffers are kept on per-thread free lists by
+// size class, up to POOL_BYTES each. Slice classes double from SMALL_MIN
+// bytes of data up to HIGH_WATER, and the last class is for nodes
+#define SMALL_MIN 32
+#define SMALL_CLASSES 16
+#define NODE_CLASS SMALL_CLASSES
+#define POOL_BYTES (1<<20)
+_Static_assert(SMALL_MIN << (SMALL_CLASSES - 1) >= HIGH_WATER,
+			"too few size classes");
+
+struct pool {
+	void *free[SMALL_CLASSES + 1];
+	size_t count[SMALL_CLASSES + 1];
+	bool registered;
+};
+
+static _Thread_local struct pool pool;
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+// empties the pool of an exiting thread
+static void pool_flush(void *arg)
+{
+	struct pool *p = arg;
+	for(int c = 0; c <= SMALL_CLASSES; c++)
+		while(p->free[c]) {
+			void *next = *(void **)p->free[c];
+			free(p->free[c]);
+			p->free[c] = next;
+		}
+}
+
+static void pool_init(void)
+{
+	pthread_key_create(&pool_key, pool_flush);
+}
+
+static void *pool_alloc(int class, size_t size)
+{
+	void *mem = pool.free[class];
+	if(!mem)
+		return class == NODE_CLASS ? aligned_alloc(CACHE_LINE, size) :
+			malloc(size);
+	pool.free[class] = *(void **)mem;
+	pool.count[class]--;
+	return mem;
+}
+
+static void pool_free(void *mem, int class, size_t size)
+{
+	if(pool.count[class] >= MAX(POOL_BYTES / size, 8)) {
+		free(mem);
+		return;
+	}
+	if(!pool.registered) {
+		pthread_once(&pool_once, pool_init);
+		pthread_setspecific(pool_key, &pool);
+		pool.registered = true;
+	}
+	*(void **)mem = pool.free[class];
+	pool.free[class] = mem;
+	pool.count[class]++;
+}
+
+/* byte scanning */
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define VECSIZE 32
+	typedef __m256i vec;
+	#define vec_load(p) _mm256_loadu_si256((const vec *)(p))
+	#define vec_splat(c) _mm256_set1_epi8(c)
+	#define vec_eqmask(a, b) \
+		((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+	#define vec_gtmask(a, b) \
+		((uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(a, b)))
+	#define VECMASK 0xFFFFFFFFu
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+	#define VECSIZE 16
+	typedef __m128i vec;
+	#define vec_load(p) _mm_loadu_si128((const vec *)(p))
+	#define vec_splat(c) _mm_set1_epi8(c)
+	#define vec_eqmask(a, b) \
+		((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)))
+	#define vec_gtmask(a, b) \
+		((uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(a, b)))
+	#define VECMASK 0xFFFFu
+#endif
+
+// returns the first occurrence of c in [s, end), or NULL
+static const char *byte_find(const char *s, const char *end, char c)
+{
+#ifdef VECSIZE
+	vec needle = vec_splat(c);
+	for(; end - s >= VECSIZE; s += VECSIZE) {
+		uint32_t mask = vec_eqmask(vec_load(s), needle);
+		if(mask)
+			return s + __builtin_ctz(mask);
+	}
+#endif
+	return memchr(s, c, end - s);
+}
+
+// returns the last occurrence of c in [s, end), or NULL
+static const char *byte_rfind(const char *s, const char *end, char c)
+{
+#ifdef VECSIZE
+	vec needle = vec_splat(c);
+	for(; end - s >= VECSIZE; end -= VECSIZE) {
+		uint32_t mask = vec_eqmask(vec_load(end - VECSIZE), needle);
+		if(mask)
+			return end - VECSIZE + (31 - __builtin_clz(mask));
+	}
+#endif
+	while(end-- > s)
+		if(*end == c)
+			return end;
+	return NULL;
+}
+
+// returns the first occurrence of the len > 0 bytes of needle in [s, end), or
+// NULL. Only where both its first and last bytes match is the rest compared
+static const char *mem_find(const char *s, const char *end,
+							const char *needle, size_t len)
+{
+	if(end - s < (long)len)
+		return NULL;
+	const char *last = end - len; // the last place it could start
+#ifdef VECSIZE
+	vec first = vec_splat(needle[0]), final = vec_splat(needle[len-1]);
+	for(; last - s >= VECSIZE - 1; s += VECSIZE) {
+		uint32_t mask = vec_eqmask(vec_load(s), first) &
+			vec_eqmask(vec_load(s + len - 1), final);
+		for(; mask; mask &= mask - 1)
+			if(!memcmp(s + __builtin_ctz(mask), needle, len))
+				return s + __builtin_ctz(mask);
+	}
+#endif
+	for(; s <= last && (s = memchr(s, needle[0], last - s + 1)); s++)
+		if(!memcmp(s, needle, len))
+			return s;
+	return NULL;
+}
+
+// returns the last occurrence of needle in [s, end), or NULL
+static const char *mem_rfind(const char *s, const char *end,
+							const char *needle, size_t len)
+{
+	if(end - s < (long)len)
+		return NULL;
+	size_t starts = end - s - len + 1; // the places it could start
+#ifdef VECSIZE
+	vec first = vec_splat(needle[0]), final = vec_splat(needle[len-1]);
+	for(; starts >= VECSIZE; starts -= VECSIZE) {
+		const char *block = s + starts - VECSIZE;
+		uint32_t mask = vec_eqmask(vec_load(block), first) &
+			vec_eqmask(vec_load(block + len - 1), final);
+		for(; mask; mask &= ~(1u << (31 - __builtin_clz(mask))))
+			if(!memcmp(block + (31 - __builtin_clz(mask)), needle, len))
+				return block + (31 - __builtin_clz(mask));
+	}
+#endif
+	while(starts-- > 0)
+		if(s[starts] == needle[0] && !memcmp(s + starts, needle, len))
+			return s + starts;
+	return NULL;
+}
+
+static bool utf8_lead(char c)
+{
+	return (c & 0xC0) != 0x80;
+}
+
+// continuation bytes are 10xxxxxx, i.e. less than -64 as signed bytes
+#define vec_leadmask(v) (~vec_gtmask(vec_splat(-64), v) & VECMASK)
+
+// returns the nth (from 1) codepoint starting in [s, end), or NULL after
+// subtracting the number of codepoints found from n
+static const char *cp_find(const char *s, const char *end, size_t *n)
+{
+#ifdef VECSIZE
+	for(; end - s >= VECSIZE; s += VECSIZE) {
+		uint32_t mask = vec_leadmask(vec_load(s));
+		size_t count = __builtin_popcount(mask);
+		if(count >= *n) {
+			while(--*n > 0)
+				mask &= mask - 1; // clear lowest set bit
+			return s + __builtin_ctz(mask);
+		}
+		*n -= count;
+	}
+#endif
+	for(; s < end; s++)
+		if(utf8_lead(*s) && --*n == 0)
+			return s;
+	return NULL;
+}
+
+// the same as above, counting backwards from end
+static const char *cp_rfind(const char *s, const char *end, size_t *n)
+{
+#ifdef VECSIZE
+	for(; end - s >= VECSIZE; end -= VECSIZE) {
+		uint32_t mask = vec_leadmask(vec_load(end - VECSIZE));
+		size_t count = __builtin_popcount(mask);
+		if(count >= *n) {
+			while(--*n > 0)
+				mask &= ~(1u << (31 - __builtin_clz(mask)));
+			return end - VECSIZE + (31 - __builtin_clz(mask));
+		}
+		*n -= count;
+	}
+#endif
+	while(end-- > s)
+		if(utf8_lead(*end) && --*n == 0)
+			return end;
+	return NULL;
+}
+
+static struct metrics measure(const char *s, size_t len)
+{
+	struct metrics m = { 0, 0 };
+	const char *end = s + len;
+#ifdef VECSIZE
+	vec newline = vec_splat('\n');
+	for(; end - s >= VECSIZE; s += VECSIZE) {
+		vec v = vec_load(s);
+		m.lines += __builtin_popcount(vec_eqmask(v, newline));
+		m.cps += __builtin_popcount(vec_leadmask(v));
+	}
+#endif
+	for(; s < end; s++) {
+		m.lines += *s == '\n';
+		m.cps += utf8_lead(*s);
+	}
+	return m;
+}
+
+static void metrics_add(struct metrics *m, struct metrics n)
+{
+	m->lines += n.lines;
+	m->cps += n.cps;
+}
+
+static void metrics_sub(struct metrics *m, struct metrics n)
+{
+	m->lines -= n.lines;
+	m->cps -= n.cps;
+}
+
+// measures data[from, to), given the metrics TOTAL of all of data[0, span).
+// Whichever of the range or its complement is shorter gets scanned, as
+// splitting a huge slice near one of its ends is the common case
+static struct metrics measure_range(const char *data, size_t span,
+									struct metrics total,
+									size_t from, size_t to)
+{
+#ifdef USETAGS
+	data = (char *)((uintptr_t)data <<1 >>1);
+#endif
+	if(to - from <= span / 2)
+		return measure(data + from, to - from);
+	metrics_sub(&total, measure(data, from));
+	metrics_sub(&total, measure(data + to, span - to));
+	return total;
+}
+
 /* tree utilities */
 
 static void print_node(const struct node *node, int level);
@@ -105,18 +562,90 @@ static void node_clrslots(struct node *node, int from, int to)
 	assert(to <= B);
 	for(int i = from; i < to; i++)
 		node->spans[i] = ULONG_MAX;
+	memset(&node->metrics[from], 0, (to - from) * sizeof(struct metrics));
 
 	memset(&node->child[from], 0, (to - from) * sizeof(void *));
 }
 
+// the token of the table being edited on this thread, if transient. Nodes
+// stamped with it belong to that table alone, as it isn't shared during a
+// session, so they can be edited without looking at refc
+static _Thread_local unsigned transient;
+
+// nodes whose spans may have changed since their ends were last computed.
+// Only the thread editing them can see them until then
+static _Thread_local struct {
+	struct node **nodes;
+	int n, cap;
+} dirty;
+
+// the edit being done on this thread, if its nodes are tracked
+static _Thread_local struct lastedit *tracking;
+
+static void touch(const struct node *node)
+{
+	if(!tracking)
+		return;
+	if(tracking->n == tracking->cap) {
+		tracking->cap = tracking->cap ? 2 * tracking->cap : 16;
+		tracking->nodes = realloc(tracking->nodes,
+								tracking->cap * sizeof *tracking->nodes);
+	}
+	tracking->nodes[tracking->n++] = node;
+}
+
+static void mark_dirty(struct node *node)
+{
+	if(node->dirty)
+		return;
+	if(dirty.n == dirty.cap) {
+		dirty.cap = dirty.cap ? 2 * dirty.cap : 64;
+		dirty.nodes = realloc(dirty.nodes, dirty.cap * sizeof *dirty.nodes);
+	}
+	dirty.nodes[dirty.n++] = node;
+	node->dirty = dirty.n;
+}
+
+// recomputes the ends and fill of the nodes changed on this thread, which must
+// be done before the tree is searched again. Empty slots end at ULONG_MAX
+static void refresh_nodes(void)
+{
+	for(int k = 0; k < dirty.n; k++) {
+		struct node *node = dirty.nodes[k];
+		size_t end = 0;
+		int i;
+		for(i = 0; i < B && node->spans[i] != ULONG_MAX; i++)
+			node->ends[i] = end += node->spans[i];
+		node->fill = i;
+		for(; i < B; i++)
+			node->ends[i] = ULONG_MAX;
+		node->dirty = 0;
+	}
+	dirty.n = 0;
+}
+
 static struct node *new_node(void)
 {
-	struct node *node = malloc(sizeof *node);
+	struct node *node = pool_alloc(NODE_CLASS, sizeof *node);
 	node_clrslots(node, 0, B);
 	atomic_store_explicit(&node->refc, 1, memory_order_relaxed);
+	node->owner = transient;
+	node->dirty = 0;
+	mark_dirty(node);
 	return node;
 }
 
+static void free_node(struct node *node)
+{
+	touch(node);
+	if(node->dirty) { // move the last in its place
+		struct node *last = dirty.nodes[--dirty.n];
+		dirty.nodes[node->dirty - 1] = last;
+		last->dirty = node->dirty;
+	}
+	pool_free(node, NODE_CLASS, sizeof *node);
+}
+
 // sums the spans of entries in node, up to fill
 static size_t node_sum(const struct node *node, int fill)
 {
@@ -126,13 +655,60 @@ static size_t node_sum(const struct node *node, int fill)
 	return sum;
 }
 
-// returns index of the first key spanning the search key in node
-// key contains the offset at the end
-static int node_offset(const struct node *node, size_t *key)
+// sums the metrics of entries in node, up to fill
+static struct metrics node_sum_metrics(const struct node *node, int fill)
+{
+	struct metrics sum = { 0, 0 };
+	for(int i = 0; i < fill; i++)
+		metrics_add(&sum, node->metrics[i]);
+	return sum;
+}
+
+#if defined(__SSE4_2__) && !defined(__AVX2__)
+	#include <nmmintrin.h>
+#endif
+
+// returns the index of the first slot spanning key in node, leaving the
+// offset into it in key. Compares key with all ends at once, so node must
+// not have been changed since the last refresh_nodes. Edits search each node
+// on the way down before changing it
+static int node_search(const struct node *node, size_t *key)
 {
-	int i = 0;
-	while(*key > node->spans[i])
-		*key -= node->spans[i++];
+	int i;
+#if defined(__AVX2__) || defined(__SSE4_2__)
+	// unsigned comparison by flipping the sign bit. The lanes past the last
+	// end read the spans after them, but come after the answer, which is
+	// the first end reaching key. Wide nodes are searched 32 ends at a time
+	for(i = 0;; i += 32) {
+		uint32_t below = 0;
+#if defined(__AVX2__)
+		__m256i sign = _mm256_set1_epi64x(INT64_MIN);
+		__m256i k = _mm256_xor_si256(_mm256_set1_epi64x(*key), sign);
+		for(int v = 0; v < 32 && i + v < B; v += 4) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)&node->ends[i+v]);
+			__m256i lt = _mm256_cmpgt_epi64(k, _mm256_xor_si256(x, sign));
+			below |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(lt)) << v;
+		}
+#else
+		__m128i sign = _mm_set1_epi64x(INT64_MIN);
+		__m128i k = _mm_xor_si128(_mm_set1_epi64x(*key), sign);
+		for(int v = 0; v < 32 && i + v < B; v += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i *)&node->ends[i+v]);
+			__m128i lt = _mm_cmpgt_epi64(k, _mm_xor_si128(x, sign));
+			below |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(lt)) << v;
+		}
+#endif
+		if(~below) {
+			i += __builtin_ctz(~below);
+			break;
+		}
+	}
+#else
+	for(i = 0; *key > node->ends[i]; i++)
+		;
+#endif
+	if(i > 0)
+		*key -= node->ends[i-1];
 	return i;
 }
 
@@ -146,22 +722,25 @@ static int node_fill(const struct node *node, int start)
 	return i;
 }
 
+static void small_drop(char *data);
+
 void drop_node(struct node *root, int level)
 {
 	if(level == 1) {
+		touch(root); // gone from the tree, if not freed
 		if(atomic_fetch_sub_explicit(&root->refc,1,memory_order_release)==1) {
 			atomic_thread_fence(memory_order_acquire);
 			for(int i = 0; i < node_fill(root, 0); i++)
 				if(root->spans[i] <= HIGH_WATER)
-					free(root->child[i]); // free small allocations
-			free(root);
+					small_drop(root->child[i]); // free small allocations
+			free_node(root);
 		}
 	} else // inner node
 		if(atomic_fetch_sub_explicit(&root->refc,1,memory_order_release)==1) {
 			atomic_thread_fence(memory_order_acquire);
 			for(int i = 0; i < node_fill(root, 0); i++)
 				drop_node(root->child[i], level - 1);
-			free(root);
+			free_node(root);
 		}
 }
 
@@ -176,23 +755,93 @@ static void incref(atomic_int *refc)
 	atomic_fetch_add_explicit(refc, 1, memory_order_relaxed);
 }
 
+// small slices are HIGH_WATER buffers behind a header, so that copies of a
+// leaf can share them until one of them is edited
+// their capacity is that of a size class, and grows as they are edited
+struct small {
+	atomic_int refc;
+	unsigned owner; // as for nodes
+	int class;
+	char data[];
+};
+
+#define SMALL(p) \
+	((struct small *)((char *)(p) - offsetof(struct small, data)))
+
+static size_t small_cap(int class)
+{
+	return MIN((size_t)SMALL_MIN << class, HIGH_WATER);
+}
+
+// with room for at least len bytes
+static char *small_new(size_t len)
+{
+	int class = 0;
+	while(small_cap(class) < len)
+		class++;
+	struct small *small = pool_alloc(class, sizeof *small + small_cap(class));
+	atomic_store_explicit(&small->refc, 1, memory_order_relaxed);
+	small->owner = transient;
+	small->class = class;
+	return small->data;
+}
+
+static void small_drop(char *data)
+{
+	struct small *small = SMALL(data);
+	if(atomic_fetch_sub_explicit(&small->refc, 1, memory_order_release) == 1) {
+		atomic_thread_fence(memory_order_acquire);
+		pool_free(small, small->class, sizeof *small + small_cap(small->class));
+	}
+}
+
+// readies the small slice at *data to grow to len bytes, copying it if it is
+// shared or too small
+static void small_reserve(char **data, size_t span, size_t len)
+{
+	struct small *small = SMALL(*data);
+	if(len <= small_cap(small->class)) {
+		if(transient && small->owner == transient)
+			return;
+		if(atomic_load_explicit(&small->refc, memory_order_acquire) == 1) {
+			small->owner = transient;
+			return;
+		}
+	}
+	char *copy = small_new(len);
+	memcpy(copy, *data, span);
+	small_drop(*data);
+	*data = copy;
+}
+
 static void ensure_node_editable(struct node **nodeptr, int level)
 {
 	struct node *node = *nodeptr;
-	if(atomic_load_explicit(&node->refc, memory_order_acquire) != 1) {
-		struct node *copy = malloc(sizeof *copy);
+	if(level == 1)
+		touch(node);
+	if(transient && node->owner == transient) {
+		mark_dirty(node);
+		return;
+	}
+	if(atomic_load_explicit(&node->refc, memory_order_acquire) == 1) {
+		node->owner = transient; // ours until the session ends
+		mark_dirty(node);
+	} else {
+		struct node *copy = pool_alloc(NODE_CLASS, sizeof *copy);
 		memcpy(copy, node, sizeof *copy);
 		atomic_store_explicit(&copy->refc, 1, memory_order_relaxed);
-		// in a leaf, copy small data blocks as we modify them inplace
-		// TODO, use a reference counted type to avoid unnecessary copying
-		int fill = node_fill(node, 0);
+		copy->owner = transient;
+		copy->dirty = 0;
+		mark_dirty(copy);
+		// in a leaf, share small slices. They are copied by small_own when
+		// modified, leaving the old node's alone. A shared node hasn't been
+		// changed by this edit, so its fill is current
+		int fill = node->fill;
+		assert(fill == node_fill(node, 0));
 		if(level == 1) {
 			for(int i = 0; i < fill; i++)
-				if(node->spans[i] <= HIGH_WATER) {
-					char *copy = malloc(HIGH_WATER);
-					memcpy(copy, node->child[i], node->spans[i]);
-					node->child[i] = copy;
-				}
+				if(node->spans[i] <= HIGH_WATER)
+					incref(&SMALL(node->child[i])->refc);
 		} else
 			for(int i = 0; i < fill; i++)
 				incref(&((struct node *)node->child[i])->refc);
@@ -202,132 +851,577 @@ static void ensure_node_editable(struct node **nodeptr, int level)
 	}
 }
 
-/* simple */
+/* transient editing */
 
-int st_depth(const SliceTable *st) { return st->levels - 1; }
+static atomic_uint tokens;
 
-size_t node_count(const struct node *node, int level)
+// never 0, and not reused in practice
+static unsigned new_token(void)
 {
-	if(level == 1)
-		return 1;
+	unsigned token;
+	while(!(token = atomic_fetch_add_explicit(&tokens, 1,
+											memory_order_relaxed) + 1))
+		;
+	return token;
+}
 
-	size_t count = 0;
-	for(int i = 0; i < node_fill(node, 0); i++)
-		count += node_count(node->child[i], level-1);
-	return count;
+void st_transient(SliceTable *st)
+{
+	if(!st->owner)
+		st->owner = new_token();
 }
 
-size_t st_node_count(const SliceTable *st)
+void st_persist(SliceTable *st)
 {
-	return node_count(st->root, st->levels);
+	st->owner = 0;
 }
 
-size_t st_size(const SliceTable *st)
+// the nodes stamped so far are about to be shared. Later edits of the session
+// copy them once, as outside of it
+static void retire_token(SliceTable *st)
 {
-	return node_sum(st->root, node_fill(st->root, 0));
+	if(st->owner)
+		st->owner = new_token();
 }
 
-SliceTable *st_new(void)
+/* marks */
+
+// marks form a treap ordered by position, with left gravity marks before
+// right gravity ones at the same position. Positions are stored relative to
+// the parent, so that moving all marks past an edit is a split, a change at
+// one root and a merge
+struct slicemark {
+	struct slicemark *parent, *left, *right;
+	// relative to the parent, or to 0 at the root. Detached marks keep their
+	// last position here, and are linked through left and right instead
+	long off;
+	unsigned prio;
+	int flags;
+	bool live;
+};
+
+// splitmix64's finalizer, so that marks allocated in a row aren't ordered
+static unsigned mark_prio(const SliceMark *mark)
 {
-	SliceTable *st = malloc(sizeof *st);
-	st->root = new_node();
-	st->blocks = NULL;
-	st->levels = 1;
-	return st;
+	uint64_t x = (uintptr_t)mark;
+	x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9;
+	x = (x ^ x >> 27) * 0x94d049bb133111eb;
+	return x ^ x >> 31;
 }
 
-SliceTable *st_new_from_file(const char *path)
+// whether a mark at pos goes before a cut at at. Side 0 cuts before all the
+// marks there, 1 between the left and right gravity ones and 2 after all
+static bool mark_before(size_t pos, int flags, size_t at, int side)
 {
-	int fd = open(path, O_RDONLY);
-	if(!fd)
-		return NULL;
-	size_t len = lseek(fd, 0, SEEK_END);
-	if(!len)
-		return st_new(); // mmap cannot handle 0-length mappings
+	return pos < at || pos == at && (flags & ST_MARK_RIGHT ? 1 : 0) < side;
+}
 
-	SliceTable *st = malloc(sizeof *st);
-	void *data;
-	if(len <= HIGH_WATER) {
-		data = malloc(HIGH_WATER);
-		lseek(fd, 0, SEEK_SET);
-		// TODO
-		if(read(fd, data, len) != len) {
-			free(data);
-			free(st);
-			return NULL;
+// splits t, relative to base, into the marks before the cut and the rest,
+// which are relative to 0
+static void mark_split(struct slicemark *t, size_t base, size_t at, int side,
+					struct slicemark **l, struct slicemark **r)
+{
+	if(!t) {
+		*l = *r = NULL;
+		return;
+	}
+	size_t pos = base + t->off;
+	t->off = pos;
+	t->parent = NULL;
+	struct slicemark *rest;
+	if(mark_before(pos, t->flags, at, side)) {
+		mark_split(t->right, pos, at, side, &rest, r);
+		if((t->right = rest)) {
+			rest->off -= pos;
+			rest->parent = t;
 		}
-		st->blocks = NULL;
+		*l = t;
 	} else {
-		data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
-		close(fd);
-		if(data == MAP_FAILED) {
-			free(st);
-			return NULL;
+		mark_split(t->left, pos, at, side, l, &rest);
+		if((t->left = rest)) {
+			rest->off -= pos;
+			rest->parent = t;
 		}
-		struct block *init = malloc(sizeof(struct block));
-		*init = (struct block){
-			.type = MMAP, .refc = 1, .data = data, .len = len, .next = NULL
-		};
-		st->blocks = init;
+		*r = t;
 	}
-	struct node *leaf = new_node();
-	leaf->spans[0] = len;
-	leaf->child[0] = data;
-	st->root = (struct node *)leaf;
-	st->levels = 1;
-	return st;
 }
 
-void st_free(SliceTable *st)
+// joins a and b, relative to the same base, where a's marks go before b's
+static struct slicemark *mark_merge(struct slicemark *a, struct slicemark *b)
 {
-	drop_node(st->root, st->levels);
-	if(st->blocks)
-		drop_block(st->blocks);
-	free(st);
+	if(!a || !b)
+		return a ? a : b;
+	if(a->prio > b->prio) {
+		b->off -= a->off;
+		a->right = mark_merge(a->right, b);
+		a->right->parent = a;
+		return a;
+	}
+	a->off -= b->off;
+	b->left = mark_merge(a, b->left);
+	b->left->parent = b;
+	return b;
 }
 
-SliceTable *st_clone(const SliceTable *st)
+static void set_marks(SliceTable *st, struct slicemark *root)
 {
-	SliceTable *clone = malloc(sizeof *clone);
-	clone->levels = st->levels;
-	clone->root = st->root;
-	clone->blocks = st->blocks;
-	incref(&st->root->refc);
-	incref(&st->blocks->refc);
-	return clone;
+	if((st->marks = root))
+		root->parent = NULL;
 }
 
-/* utilities */
+static void detach_mark(SliceTable *st, SliceMark *mark, size_t pos)
+{
+	mark->live = false;
+	mark->off = pos;
+	mark->parent = mark->left = NULL;
+	if((mark->right = st->detached))
+		mark->right->left = mark;
+	st->detached = mark;
+}
 
-struct block *slice_insert(void **target_ptr, size_t offset,
-						const char *data, size_t len, size_t *tspan)
+// takes the marks of t, relative to base, out of the treap. Those strictly
+// within [pos, pos + del) that ask for it are detached, the others go to
+// left or right at pos or pos + len, by gravity
+static void collapse_marks(SliceTable *st, struct slicemark *t, size_t base,
+						size_t pos, size_t del, size_t len, bool detach,
+						struct slicemark **left, struct slicemark **right)
 {
-	size_t oldspan = *tspan;
-	char *target = *target_ptr;
-#ifdef USETAGS
-	// if target is tagged as LARGE, untag and copy it
-	if((uintptr_t)target >> 63) {
-		char *new = malloc(HIGH_WATER);
-		memcpy(new, (void *)((uintptr_t)target <<1 >>1), oldspan);
-		*target_ptr = target = new;
+	if(!t)
+		return;
+	size_t at = base + t->off;
+	collapse_marks(st, t->left, at, pos, del, len, detach, left, right);
+	collapse_marks(st, t->right, at, pos, del, len, detach, left, right);
+	t->parent = t->left = t->right = NULL;
+	if(detach && t->flags & ST_MARK_DETACH && at > pos && at - pos < del)
+		detach_mark(st, t, pos);
+	else if(t->flags & ST_MARK_RIGHT) {
+		t->off = pos + len;
+		*right = mark_merge(*right, t);
+	} else {
+		t->off = pos;
+		*left = mark_merge(*left, t);
 	}
-	// untag data for copying
-	if((uintptr_t)data >> 63)
-		data = (char *)((uintptr_t)data <<1 >>1);
-#endif
-	size_t newspan = oldspan + len;
+}
+
+// moves the marks for del bytes at pos being replaced by len bytes. Inserts
+// are the common case, and only cost a split and a merge
+static void move_marks(SliceTable *st, size_t pos, size_t del, size_t len,
+					bool detach)
+{
+	struct slicemark *head, *mid, *tail, *left = NULL, *right = NULL;
+	if(!st->marks)
+		return;
+	if(del == 0) {
+		mark_split(st->marks, 0, pos, 1, &head, &tail);
+		if(tail)
+			tail->off += len;
+		set_marks(st, mark_merge(head, tail));
+		return;
+	}
+	mark_split(st->marks, 0, pos, 0, &head, &tail);
+	mark_split(tail, 0, pos + del, 2, &mid, &tail);
+	if(tail)
+		tail->off += (long)len - (long)del;
+	collapse_marks(st, mid, 0, pos, del, len, detach, &left, &right);
+	set_marks(st, mark_merge(mark_merge(head, left), mark_merge(right, tail)));
+}
+
+static void insert_mark(SliceTable *st, SliceMark *mark, size_t pos)
+{
+	struct slicemark *head, *tail;
+	mark_split(st->marks, 0, pos, mark->flags & ST_MARK_RIGHT ? 2 : 1,
+			&head, &tail);
+	mark->off = pos;
+	mark->live = true;
+	set_marks(st, mark_merge(mark_merge(head, mark), tail));
+}
+
+SliceMark *st_mark_new(SliceTable *st, size_t pos, int flags)
+{
+	if(pos > st_size(st))
+		return NULL;
+	SliceMark *mark = calloc(1, sizeof *mark);
+	mark->prio = mark_prio(mark);
+	mark->flags = flags;
+	insert_mark(st, mark, pos);
+	return mark;
+}
+
+// removes the mark from the treap or the list of detached marks
+static void unlink_mark(SliceTable *st, SliceMark *mark)
+{
+	struct slicemark *sub, **slot;
+	if(mark->live) {
+		if(mark->left)
+			mark->left->off += mark->off;
+		if(mark->right)
+			mark->right->off += mark->off;
+		sub = mark_merge(mark->left, mark->right);
+		if(sub)
+			sub->parent = mark->parent;
+		slot = !mark->parent ? &st->marks : mark->parent->left == mark ?
+			&mark->parent->left : &mark->parent->right;
+		*slot = sub;
+	} else {
+		if(mark->right)
+			mark->right->left = mark->left;
+		*(mark->left ? &mark->left->right : &st->detached) = mark->right;
+	}
+	mark->parent = mark->left = mark->right = NULL;
+}
+
+void st_mark_free(SliceTable *st, SliceMark *mark)
+{
+	unlink_mark(st, mark);
+	free(mark);
+}
+
+size_t st_mark_pos(const SliceMark *mark)
+{
+	size_t pos = mark->off;
+	if(mark->live)
+		while((mark = mark->parent))
+			pos += mark->off;
+	return pos;
+}
+
+bool st_mark_live(const SliceMark *mark)
+{
+	return mark->live;
+}
+
+bool st_mark_set(SliceTable *st, SliceMark *mark, size_t pos)
+{
+	if(pos > st_size(st))
+		return false;
+	unlink_mark(st, mark);
+	insert_mark(st, mark, pos);
+	return true;
+}
+
+static void free_marks(struct slicemark *t)
+{
+	if(!t)
+		return;
+	free_marks(t->left);
+	free_marks(t->right);
+	free(t);
+}
+
+static void free_detached(struct slicemark *mark)
+{
+	while(mark) {
+		struct slicemark *next = mark->right;
+		free(mark);
+		mark = next;
+	}
+}
+
+/* history */
+
+// a past version of a table. Versions share structure with each other
+struct version {
+	struct node *root;
+	struct blockset *blocks;
+	int levels;
+	size_t cost; // rough estimate of the memory held by this version alone
+};
+
+enum edit { INSERT, DELETE, OTHER };
+
+// edits of up to this many bytes continuing the last one are coalesced
+#define TYPING 16
+
+struct history {
+	// oldest first
+	struct version *undo, *redo;
+	size_t nundo, nredo, undocap, redocap;
+	size_t cost, budget; // of all versions
+	// whether the next edit may extend the last group, were it typing
+	bool open;
+	enum edit kind;
+	size_t pos; // where the next typing edit would be
+};
+
+// takes a reference to the current version
+static struct version current_version(const SliceTable *st)
+{
+	incref(&st->root->refc);
+	return (struct version){
+		st->root, share_blocks(st->blocks), st->levels, 0
+	};
+}
+
+static void drop_version(struct version v)
+{
+	drop_node(v.root, v.levels);
+	drop_blocks(v.blocks);
+}
+
+static void push_version(struct version **stack, size_t *n, size_t *cap,
+						struct version v)
+{
+	if(*n == *cap) {
+		*cap = *cap ? 2 * *cap : 16;
+		*stack = realloc(*stack, *cap * sizeof **stack);
+	}
+	(*stack)[(*n)++] = v;
+}
+
+static void free_history(struct history *h)
+{
+	for(size_t i = 0; i < h->nundo; i++)
+		drop_version(h->undo[i]);
+	for(size_t i = 0; i < h->nredo; i++)
+		drop_version(h->redo[i]);
+	free(h->undo);
+	free(h->redo);
+	free(h);
+}
+
+// called before each edit, to keep the version it changes unless the edit
+// continues the group of the last one
+static void record_edit(SliceTable *st, enum edit kind, size_t pos,
+						size_t len)
+{
+	struct history *h = st->history;
+	if(!h)
+		return;
+	while(h->nredo > 0) {
+		h->cost -= h->redo[--h->nredo].cost;
+		drop_version(h->redo[h->nredo]);
+	}
+	bool typing = h->open && kind == h->kind && len <= TYPING &&
+		(kind == INSERT && pos == h->pos ||
+		 kind == DELETE && (pos == h->pos || pos + len == h->pos));
+	if(!typing) {
+		push_version(&h->undo, &h->nundo, &h->undocap, current_version(st));
+		retire_token(st);
+	}
+	h->open = true;
+	h->kind = kind;
+	h->pos = kind == INSERT ? pos + len : pos;
+	// the copied path and the inserted or deleted text
+	size_t cost = st->levels * sizeof(struct node) + len;
+	h->undo[h->nundo-1].cost += cost;
+	h->cost += cost;
+	// keeping at least the last version
+	size_t drop = 0;
+	while(h->cost > h->budget && drop < h->nundo - 1) {
+		h->cost -= h->undo[drop].cost;
+		drop_version(h->undo[drop++]);
+	}
+	h->nundo -= drop;
+	memmove(h->undo, &h->undo[drop], h->nundo * sizeof *h->undo);
+}
+
+// called before each edit after record_edit, to keep what it does for
+// st_iter_refresh. Only inserts and deletes are tracked
+static void track_edit(SliceTable *st, enum edit kind, size_t pos,
+						size_t len)
+{
+	st->version++;
+	if(!st->last)
+		st->last = calloc(1, sizeof *st->last);
+	struct lastedit *e = st->last;
+	e->known = kind != OTHER;
+	e->pos = pos;
+	e->del = kind == DELETE ? len : 0;
+	e->len = kind == INSERT ? len : 0;
+	e->n = 0;
+	tracking = e->known ? e : NULL;
+}
+
+void st_set_history(SliceTable *st, size_t budget)
+{
+	if(budget == 0) {
+		if(st->history)
+			free_history(st->history);
+		st->history = NULL;
+		return;
+	}
+	if(!st->history)
+		st->history = calloc(1, sizeof *st->history);
+	st->history->budget = budget;
+}
+
+void st_commit(SliceTable *st)
+{
+	if(st->history)
+		st->history->open = false;
+}
+
+// moves the current version onto one stack and the top of the other in
+static bool swap_version(SliceTable *st, struct version *from, size_t *nfrom,
+						struct version **to, size_t *nto, size_t *tocap)
+{
+	if(*nfrom == 0)
+		return false;
+	struct version v = from[--*nfrom];
+	push_version(to, nto, tocap, (struct version){
+		st->root, st->blocks, st->levels, v.cost
+	});
+	st->root = v.root;
+	st->blocks = v.blocks;
+	st->levels = v.levels;
+	st->history->open = false;
+	retire_token(st);
+	track_edit(st, OTHER, 0, 0);
+	// we don't know what changed, so marks only stay within the table
+	move_marks(st, st_size(st), SIZE_MAX - st_size(st), 0, false);
+	return true;
+}
+
+bool st_undo(SliceTable *st)
+{
+	struct history *h = st->history;
+	return h && swap_version(st, h->undo, &h->nundo, &h->redo, &h->nredo,
+							&h->redocap);
+}
+
+bool st_redo(SliceTable *st)
+{
+	struct history *h = st->history;
+	return h && swap_version(st, h->redo, &h->nredo, &h->undo, &h->nundo,
+							&h->undocap);
+}
+
+/* simple */
+
+int st_depth(const SliceTable *st) { return st->levels - 1; }
+
+size_t node_count(const struct node *node, int level)
+{
+	if(level == 1)
+		return 1;
+
+	size_t count = 0;
+	for(int i = 0; i < node_fill(node, 0); i++)
+		count += node_count(node->child[i], level-1);
+	return count;
+}
+
+size_t st_node_count(const SliceTable *st)
+{
+	return node_count(st->root, st->levels);
+}
+
+size_t st_size(const SliceTable *st)
+{
+	return node_sum(st->root, node_fill(st->root, 0));
+}
+
+static struct metrics root_metrics(const SliceTable *st)
+{
+	return node_sum_metrics(st->root, node_fill(st->root, 0));
+}
+
+size_t st_newlines(const SliceTable *st) { return root_metrics(st).lines; }
+size_t st_codepoints(const SliceTable *st) { return root_metrics(st).cps; }
+
+// a table around root, with no history, marks or session of its own
+static SliceTable *new_table(struct node *root, int levels,
+							struct blockset *blocks)
+{
+	SliceTable *st = malloc(sizeof *st);
+	*st = (SliceTable){ .root = root, .levels = levels, .blocks = blocks };
+	return st;
+}
+
+SliceTable *st_new(void)
+{
+	SliceTable *st = new_table(new_node(), 1, NULL);
+	refresh_nodes();
+	return st;
+}
+
+static SliceTable *map_file(int fd, size_t len);
+
+SliceTable *st_new_from_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	size_t len = lseek(fd, 0, SEEK_END);
+	if(!len) {
+		close(fd);
+		return st_new(); // mmap cannot handle 0-length mappings
+	}
+	if(len > HIGH_WATER)
+		return map_file(fd, len);
+
+	void *data = small_new(len);
+	lseek(fd, 0, SEEK_SET);
+	// TODO
+	ssize_t res = read(fd, data, len);
+	close(fd);
+	if(res != (ssize_t)len) {
+		small_drop(data);
+		return NULL;
+	}
+	struct node *leaf = new_node();
+	leaf->spans[0] = len;
+	leaf->metrics[0] = measure(data, len);
+	leaf->child[0] = data;
+	refresh_nodes();
+	return new_table(leaf, 1, NULL);
+}
+
+void st_free(SliceTable *st)
+{
+	if(st->history)
+		free_history(st->history);
+	drop_node(st->root, st->levels);
+	drop_blocks(st->blocks);
+	if(st->last)
+		free(st->last->nodes);
+	free(st->last);
+	free_marks(st->marks);
+	free_detached(st->detached);
+	free(st);
+}
+
+SliceTable *st_clone(const SliceTable *st)
+{
+	assert(!st->owner && "transient tables must be persisted first");
+	incref(&st->root->refc);
+	return new_table(st->root, st->levels, share_blocks(st->blocks));
+}
+
+/* utilities */
+
+struct block *slice_insert(void **target_ptr, size_t offset,
+						const char *data, size_t len, size_t *tspan)
+{
+	size_t oldspan = *tspan;
+	char *target = *target_ptr;
+#ifdef USETAGS
+	// if target is tagged as LARGE, untag and copy it
+	if((uintptr_t)target >> 63) {
+		char *new = small_new(oldspan);
+		memcpy(new, (void *)((uintptr_t)target <<1 >>1), oldspan);
+		*target_ptr = target = new;
+	}
+	// untag data for copying
+	if((uintptr_t)data >> 63)
+		data = (char *)((uintptr_t)data <<1 >>1);
+#endif
+	size_t newspan = oldspan + len;
 	*tspan = newspan;
 
 	if(newspan <= HIGH_WATER) {
-		block_insert(target, oldspan, offset, data, len);
+		small_reserve((char **)target_ptr, oldspan, newspan);
+		block_insert(*target_ptr, oldspan, offset, data, len);
 		return NULL;
 	} else {
 		struct block *new = malloc(sizeof *new);
 		new->len = newspan;
-		target = realloc(target, new->len);
-		new->data = target;
-		memmove(target + offset + len, &target[offset], oldspan - offset);
-		memcpy(target + offset, data, len);
+		new->data = malloc(new->len);
+		memcpy(new->data, target, offset);
+		memcpy(new->data + offset, data, len);
+		memcpy(new->data + offset + len, target + offset, oldspan - offset);
+		small_drop(target);
+		*target_ptr = new->data;
 		new->type = HEAP;
 		// we have exclusive access here
 		atomic_store_explicit(&new->refc, 1, memory_order_relaxed);
@@ -335,21 +1429,25 @@ struct block *slice_insert(void **target_ptr, size_t offset,
 	}
 }
 
-int merge_slices(size_t spans[static 5], char *data[static 5],
-				int fill)
+int merge_slices(size_t spans[], struct metrics metrics[],
+				char *data[], int fill)
 {
 	int i = 1;
 	while(i < fill) {
 		if(spans[i] + spans[i-1] <= HIGH_WATER) {
 			// We only worry about underfull nodes, so no need to handle split
-			slice_insert(&data[i-1], spans[i-1], data[i], spans[i], &spans[i-1]);
+			slice_insert((void **)&data[i-1], spans[i-1], data[i], spans[i],
+						&spans[i-1]);
+			metrics_add(&metrics[i-1], metrics[i]);
 #ifdef USETAGS // free if not tagged as large
 			if(!((uintptr_t)data[i] >> 63))
-				free(data[i]);
+				small_drop(data[i]);
 #else
-			free(data[i]);
+			small_drop(data[i]);
 #endif
 			memmove(&spans[i], &spans[i+1], (fill - (i+1)) * sizeof(size_t));
+			memmove(&metrics[i], &metrics[i+1],
+					(fill - (i+1)) * sizeof(struct metrics));
 			memmove(&data[i], &data[i+1], (fill - (i+1)) * sizeof(char *));
 			fill--;
 		} else // couldn't merge, proceed to next pair
@@ -363,6 +1461,8 @@ static struct node *split_node(struct node *node, int offset)
 	struct node *split = new_node();
 	int count = B - offset;
 	memcpy(&split->spans[0], &node->spans[offset], count * sizeof(size_t));
+	memcpy(&split->metrics[0], &node->metrics[offset],
+			count * sizeof(struct metrics));
 	memcpy(&split->child[0], &node->child[offset], count * sizeof(void *));
 	node_clrslots(node, offset, B);
 	return split;
@@ -377,17 +1477,23 @@ size_t rebalance_node(struct node * restrict i, struct node * restrict j,
 	if(i_on_left) {
 		for(int c = 0; c < count; c++) {
 			i->spans[ifill+c] = j->spans[c];
+			i->metrics[ifill+c] = j->metrics[c];
 			i->child[ifill+c] = j->child[c];
 			delta += i->spans[ifill+c];
 		}
 		memmove(&j->spans[0], &j->spans[count], (jfill-count)*sizeof(size_t));
+		memmove(&j->metrics[0], &j->metrics[count],
+				(jfill-count)*sizeof(struct metrics));
 		memmove(&j->child[0], &j->child[count], (jfill-count)*sizeof(void *));
 		node_clrslots(j, jfill - count, jfill);
 	} else {
 		memmove(&i->spans[count], &i->spans[0], ifill * sizeof(size_t));
+		memmove(&i->metrics[count], &i->metrics[0],
+				ifill * sizeof(struct metrics));
 		memmove(&i->child[count], &i->child[0], ifill * sizeof(void *));
 		for(int c = 0; c < count; c++) {
 			i->spans[c] = j->spans[jfill-count+c];
+			i->metrics[c] = j->metrics[jfill-count+c];
 			i->child[c] = j->child[jfill-count+c];
 			delta += i->spans[c];
 		}
@@ -404,7 +1510,8 @@ size_t merge_boundary(struct node **lptr, int lfill)
 	if(l->spans[lfill-1] + r->spans[0] <= HIGH_WATER) {
 		size_t delta = l->spans[lfill-1];
 		slice_insert(&r->child[0], 0, l->child[lfill-1], delta, &r->spans[0]);
-		free(l->child[lfill-1]);
+		metrics_add(&r->metrics[0], l->metrics[lfill-1]);
+		small_drop(l->child[lfill-1]);
 		node_clrslots(l, lfill - 1, lfill);
 		return delta;
 	}
@@ -415,15 +1522,68 @@ size_t merge_boundary(struct node **lptr, int lfill)
 // root(j) **MUST** be editable and its slices must have been moved already
 void node_remove(struct node *root, int fill, int j)
 {
-	free(root->child[j]); // slices shifted over, no need for full drop
+	free_node(root->child[j]); // slices shifted over, no need for full drop
 	size_t count = fill - (j+1);
 	memmove(&root->spans[j], &root->spans[j+1], count * sizeof(size_t));
+	memmove(&root->metrics[j], &root->metrics[j+1],
+			count * sizeof(struct metrics));
 	memmove(&root->child[j], &root->child[j+1], count * sizeof(void *));
 	node_clrslots(root, fill - 1, fill);
 }
 
+// metrics of the ith child of an inner node
+static struct metrics child_metrics(const struct node *root, int i)
+{
+	const struct node *child = root->child[i];
+	return node_sum_metrics(child, node_fill(child, 0));
+}
+
 /* the complex stuff */
 
+// merges or rebalances the ith child of root, which has underflowed with
+// childsize slots (ULONG_MAX if empty), with a neighbour. If they merge,
+// root loses a slot and *splitsize is set should it underflow in turn
+static void fix_underflow(struct node *root, int level, int i,
+						size_t childsize, size_t *splitsize)
+{
+	st_dbg("handling underflow at %d, level %d\n", i, level);
+	int j = i > 0 ? i-1 : i+1;
+	int fill = node_fill(root, i);
+	long shifted = 0;
+	// 
+	if(childsize == ULONG_MAX)
+		root->spans[j = i] = 0; // mark j = i as deleted
+	else {
+		int jfill = node_fill((void *)root->child[j], 0);
+		// i may be shared when joining trees
+		ensure_node_editable((void *)&root->child[i], level - 1);
+		ensure_node_editable((void *)&root->child[j], level - 1);
+		if(level-1 == 1) {
+			size_t res;
+			if(i < j) {
+				if(res = merge_boundary((void *)&root->child[i], childsize))
+					childsize--, shifted -= res;
+			} else // j < i
+				if(res = merge_boundary((void *)&root->child[j], jfill))
+					jfill--, shifted += res;
+		}
+		// transfer some slots from j to i
+		shifted += rebalance_node((void *)root->child[i],
+								(void *)root->child[j],
+								childsize, jfill, i < j);
+	}
+	root->spans[i] += shifted;
+	root->spans[j] -= shifted;
+	root->metrics[i] = child_metrics(root, i);
+	// j was merged into oblivion
+	if(root->spans[j] == 0) {
+		node_remove(root, fill, j); // propagate underflow up
+		if(fill - 1 < B/2 + (B&1))
+			*splitsize = fill - 1;
+	} else
+		root->metrics[j] = child_metrics(root, j);
+}
+
 typedef long (*leaf_case)(struct node *leaf, size_t pos, long *span,
 						struct node **split, size_t *splitsize, void *ctx);
 
@@ -437,20 +1597,23 @@ static long edit_recurse(SliceTable *st, int level, struct node *root,
 	else { // level > 1: node node recursion
 		struct node *childsplit = NULL;
 		size_t childsize = 0;
-		int i = node_offset(root, &pos);
+		int i = node_search(root, &pos);
 
 		ensure_node_editable((struct node **)&root->child[i], level - 1);
 		long delta = edit_recurse(st, level - 1, root->child[i], pos, span,
 								base_case, ctx, &childsplit, &childsize);
 		st_dbg("applying upwards delta at level %d: %ld\n", level, delta);
 		root->spans[i] += delta;
+		root->metrics[i] = child_metrics(root, i);
 		// reset delta
 		delta = *span;
 
 		if(childsize) {
 			if(childsplit) { // overflow: attempt to insert childsplit at i+1
 				i++;
-				int fill = node_fill(root, i);
+				// only spans[i - 1] has changed since the search
+				int fill = root->fill;
+				assert(fill == node_fill(root, 0));
 				if(fill == B) {
 					fill = B/2 + (i > B/2);
 					*split = split_node(root, fill);
@@ -464,65 +1627,50 @@ static long edit_recurse(SliceTable *st, int level, struct node *root,
 					}
 				}
 				size_t *start = &root->spans[i];
+				struct metrics *mstart = &root->metrics[i];
 				struct node **cstart = (struct node **)&root->child[i];
 				memmove(start + 1, start, (fill - i) * sizeof(size_t));
+				memmove(mstart + 1, mstart, (fill - i) * sizeof(struct metrics));
 				memmove(cstart + 1, cstart, (fill - i) * sizeof(void*));
 				root->spans[i] = childsize;
 				root->child[i] = childsplit;
-			} else { // children[i] underflowed
-				st_dbg("handling underflow at %d, level %d\n", i, level);
-				int j = i > 0 ? i-1 : i+1;
-				int fill = node_fill(root, i);
-				long shifted = 0;
-				// 
-				if(childsize == ULONG_MAX)
-					root->spans[j = i] = 0; // mark j = i as deleted
-				else {
-					int jfill = node_fill((void *)root->child[j], 0);
-					ensure_node_editable((void *)&root->child[j], level - 1);
-					if(level-1 == 1) {
-						size_t res;
-						if(i < j) {
-							if(res = merge_boundary((void *)&root->child[i],
-													childsize))
-								childsize--, shifted -= res;
-						} else // j < i
-							if(res = merge_boundary((void *)&root->child[j],
-													jfill))
-								jfill--, shifted += res;
-					}
-					// transfer some slots from j to i
-					shifted += rebalance_node((void *)root->child[i],
-											(void *)root->child[j],
-											childsize, jfill, i < j);
-				}
-				root->spans[i] += shifted;
-				root->spans[j] -= shifted;
-				// j was merged into oblivion
-				if(root->spans[j] == 0) {
-					node_remove(root, fill, j); // propagate underflow up
-					if(fill - 1 < B/2 + (B&1))
-						*splitsize = fill - 1;
-				}
-			}
+				root->metrics[i] = child_metrics(root, i);
+			} else // children[i] underflowed
+				fix_underflow(root, level, i, childsize, splitsize);
 		}
 		return delta;
 	}
 }
 
+// handles root underflow, removing inner roots with a single child
+static void collapse_root(SliceTable *st)
+{
+	while(st->levels > 1 && node_fill(st->root, 0) == 1) {
+		st_dbg("handling root underflow\n");
+		struct node *oldroot = st->root;
+		st->root = st->root->child[0];
+		free_node(oldroot);
+		st->levels--;
+	}
+}
+
 /* insertion */
 
 static long insert_within_slice(struct node *leaf, int fill,
 							int i, size_t off, char *new, size_t newlen,
+							struct metrics newmetrics,
 							struct node **split, size_t *splitsize)
 {
 	size_t *left_span = &leaf->spans[i];
+	struct metrics *left_metrics = &leaf->metrics[i];
 	char **left = (char **)&leaf->child[i];
 	size_t right_span = *left_span - off;
+	struct metrics right_metrics = measure_range(*left, *left_span,
+												*left_metrics, off, *left_span);
 	char *right;
 	// maintain block uniqueness
 	if(right_span <= HIGH_WATER) {
-		right = malloc(HIGH_WATER);
+		right = small_new(right_span);
 		memcpy(right, *left + off, right_span);
 	} else
 		right = *left + off;
@@ -530,46 +1678,56 @@ static long insert_within_slice(struct node *leaf, int fill,
 	assert(off > 0); // should be handled by general case
 	// demote left slice if necessary
 	if(leaf->spans[i] > HIGH_WATER && off <= HIGH_WATER) {
-		char *new = malloc(HIGH_WATER);
+		char *new = small_new(off);
 		memcpy(new, *left, off);
 		*left = new;
 	} // then truncate
 	*left_span = off;
+	metrics_sub(left_metrics, right_metrics);
 	// fill tmp
 	size_t tmpspans[5];
+	struct metrics tmpmetrics[5];
 	char *tmp[5];
 	int tmpfill = 0;
 	if(i > 0) {
 		tmpspans[tmpfill] = leaf->spans[i-1];
+		tmpmetrics[tmpfill] = leaf->metrics[i-1];
 		tmp[tmpfill++] = leaf->child[i-1];
 	}
 	tmpspans[tmpfill] = *left_span;
+	tmpmetrics[tmpfill] = *left_metrics;
 	tmp[tmpfill++] = *left;
 	tmpspans[tmpfill] = newlen;
+	tmpmetrics[tmpfill] = newmetrics;
 	tmp[tmpfill++] = new;
 	tmpspans[tmpfill] = right_span;
+	tmpmetrics[tmpfill] = right_metrics;
 	tmp[tmpfill++] = right;
 
 	if(i+1 < fill) {
 		tmpspans[tmpfill] = leaf->spans[i+1];
+		tmpmetrics[tmpfill] = leaf->metrics[i+1];
 		tmp[tmpfill++] = leaf->child[i+1];
 	}
-	int newfill = merge_slices(tmpspans, tmp, tmpfill);
+	int newfill = merge_slices(tmpspans, tmpmetrics, tmp, tmpfill);
 	int delta = tmpfill - newfill;
 	assert(delta <= 3); // [S][S1|Si|S2][S] -> [L][S], S1+S2 > HIGH_WATER
 	st_dbg("merged %d nodes\n", delta);
 	if(i > 0) {
-		i--, left_span--, left--; // see above
+		i--, left_span--, left_metrics--, left--; // see above
 	}
 	int realfill = fill - (delta-2);
 	if(realfill <= B) {
 		size_t count = fill - (i + (tmpfill-2));
 		memmove(left_span + newfill, left_span + (tmpfill-2),
 				count * sizeof(size_t));
+		memmove(left_metrics + newfill, left_metrics + (tmpfill-2),
+				count * sizeof(struct metrics));
 		memmove(left + newfill, left + (tmpfill-2), count * sizeof(char *));
 		// when delta == 0, newfill exceeds tmpfill-2 and may overwrite
 		// old slots, so we copy afterwards
 		memcpy(left_span, tmpspans, newfill * sizeof(size_t));
+		memcpy(left_metrics, tmpmetrics, newfill * sizeof(struct metrics));
 		memcpy(left, tmp, newfill * sizeof(char *));
 		if(delta > 2)
 			node_clrslots(leaf, realfill, fill);
@@ -578,15 +1736,20 @@ static long insert_within_slice(struct node *leaf, int fill,
 		return newlen;
 	} else { // realfill > B: leaf split, we have at most 2 new slices
 		size_t spans[B + 2];
+		struct metrics metrics[B + 2];
 		char *blocks[B + 2];
 		// copy all data to temporary buffers and distribute
 		memcpy(spans, leaf->spans, i * sizeof(size_t));
+		memcpy(metrics, leaf->metrics, i * sizeof(struct metrics));
 		memcpy(blocks, leaf->child, i * sizeof(char *));
 		memcpy(&spans[i], tmpspans, newfill * sizeof(size_t));
+		memcpy(&metrics[i], tmpmetrics, newfill * sizeof(struct metrics));
 		memcpy(&blocks[i], tmp, newfill * sizeof(char *));
 		int count = fill - (i + (tmpfill-2));
 		memcpy(&spans[i+newfill], &leaf->spans[i+tmpfill-2],
 				count * sizeof(size_t));
+		memcpy(&metrics[i+newfill], &leaf->metrics[i+tmpfill-2],
+				count * sizeof(struct metrics));
 		memcpy(&blocks[i+newfill], &leaf->child[i+tmpfill-2],
 				count * sizeof(char *));
 		struct node *right_split = new_node();
@@ -595,9 +1758,13 @@ static long insert_within_slice(struct node *leaf, int fill,
 		size_t new_node_fill = B/2 + 1; // B=5 6,7 -> 3,4 in right
 		size_t right_fill = realfill - (B/2 + 1); // B=4 5,6 -> 2,3 in right
 		memcpy(leaf->spans, spans, new_node_fill * sizeof(size_t));
+		memcpy(leaf->metrics, metrics,
+				new_node_fill * sizeof(struct metrics));
 		memcpy(leaf->child, blocks, new_node_fill * sizeof(char *));
 		memcpy(right_split->spans, &spans[new_node_fill],
 				right_fill * sizeof(size_t));
+		memcpy(right_split->metrics, &metrics[new_node_fill],
+				right_fill * sizeof(struct metrics));
 		memcpy(right_split->child, &blocks[new_node_fill],
 				right_fill * sizeof(char *));
 		node_clrslots(leaf, new_node_fill, fill);
@@ -611,50 +1778,52 @@ static long insert_within_slice(struct node *leaf, int fill,
 
 struct insert_ctx {
 	const char *data;
+	struct metrics metrics; // of data
 	SliceTable *st; // for attaching new blocks
 };
 
 static long insert_leaf(struct node *leaf, size_t pos, long *span,
 						struct node **split, size_t *splitsize, void *ctx)
 {
-	int i = node_offset(leaf, &pos);
-	int fill = node_fill(leaf, i);
+	int i = node_search(leaf, &pos);
+	int fill = leaf->fill; // as yet unchanged, like ends
+	assert(fill == node_fill(leaf, 0));
 	st_dbg("insertion: found slot %d, offset %zu target fill %d\n",
 			i, pos, fill);
 	size_t len = *span;
 	long delta = len;
 	bool at_bound = (pos == leaf->spans[i]);
 	const char *data = ((struct insert_ctx *)ctx)->data;
+	struct metrics metrics = ((struct insert_ctx *)ctx)->metrics;
 	SliceTable *st = ((struct insert_ctx *)ctx)->st;
+	// an empty leaf has a span of ULONG_MAX, which would wrap around below
+	bool empty = leaf->spans[0] == ULONG_MAX;
 	// if we are inserting at 0, pos will be 0
-	if(pos == 0 && leaf->spans[0]+len <= HIGH_WATER) {
+	if(pos == 0 && (empty ? len : leaf->spans[0]+len) <= HIGH_WATER) {
 		assert(i == 0);
-		if(leaf->spans[0] == ULONG_MAX) { // empty document insertion
+		if(empty) { // empty document insertion
 			leaf->spans[0] = len;
-			leaf->child[0] = malloc(HIGH_WATER);
+			leaf->child[0] = small_new(len);
 			memcpy(leaf->child[0], data, len);
 		} else
 			slice_insert(&leaf->child[0], 0, data, len, &leaf->spans[0]);
+		metrics_add(&leaf->metrics[0], metrics);
 	}
-	else if(leaf->spans[i]+len <= HIGH_WATER) {
+	else if(!empty && leaf->spans[i]+len <= HIGH_WATER) {
 		slice_insert(&leaf->child[i], pos, data, len, &leaf->spans[i]);
+		metrics_add(&leaf->metrics[i], metrics);
 	} // try start of i+1
 	else if(at_bound && (i < fill-1) && leaf->spans[i+1]+len <= HIGH_WATER) {
 		slice_insert(&leaf->child[i+1], 0, data, len, &leaf->spans[i+1]);
+		metrics_add(&leaf->metrics[i+1], metrics);
 	} // all has failed, we must make a copy and deal with splitting
 	else {
 		char *copy;
 		if(len > HIGH_WATER) {
 			copy = malloc(len);
-			struct block *new = malloc(sizeof *new);
-			new->data = copy;
-			new->type = HEAP;
-			new->len = len;
-			atomic_store_explicit(&new->refc, 1, memory_order_relaxed);
-			new->next = st->blocks;
-			st->blocks = new; // still pointing, no refc update
+			add_block(st, new_block(HEAP, copy, len));
 		} else {
-			copy = malloc(HIGH_WATER);
+			copy = small_new(len);
 		}
 		memcpy(copy, data, len);
 		// insertion on boundary [L]|[L], no merging possible
@@ -673,11 +1842,14 @@ static long insert_leaf(struct node *leaf, size_t pos, long *span,
 				}
 			}
 			memmove(&leaf->spans[i+1],&leaf->spans[i],(fill-i)*sizeof(size_t));
+			memmove(&leaf->metrics[i+1], &leaf->metrics[i],
+					(fill-i)*sizeof(struct metrics));
 			memmove(&leaf->child[i+1],&leaf->child[i],(fill-i)*sizeof(char *));
 			leaf->spans[i] = len;
+			leaf->metrics[i] = metrics;
 			leaf->child[i] = copy;
 		} else
-			return insert_within_slice(leaf, fill, i, pos, copy, len,
+			return insert_within_slice(leaf, fill, i, pos, copy, len, metrics,
 									split, splitsize);
 	}
 	return delta;
@@ -691,63 +1863,75 @@ bool st_insert(SliceTable *st, size_t pos, const char *data, size_t len)
 		return true;
 
 	st_dbg("st_insert at pos %zd of len %zd\n", pos, len);
+	record_edit(st, INSERT, pos, len);
+	track_edit(st, INSERT, pos, len);
+	move_marks(st, pos, 0, len, true);
+	transient = st->owner;
 	struct node *split = NULL;
 	size_t splitsize;
 	long span = (long)len;
-	struct insert_ctx ctx = { .data = data, .st = st };
+	struct insert_ctx ctx = {
+		.data = data, .metrics = measure(data, len), .st = st
+	};
 
 	ensure_node_editable(&st->root, st->levels);
 	edit_recurse(st, st->levels, st->root, pos, &span, &insert_leaf, &ctx,
 				&split, &splitsize);
-	// handle root underflow
-	if(st->levels > 1 && node_fill(st->root, 0) == 1) {
-		st_dbg("handling root underflow\n");
-		struct node *oldroot = st->root;
-		st->root = st->root->child[0];
-		free(oldroot);
-		st->levels--;
-	}
+	collapse_root(st);
 	// handle root split
 	if(split) {
 		st_dbg("allocating new root\n");
 		struct node *newroot = new_node();
 		newroot->spans[0] = st_size(st);
+		newroot->metrics[0] = root_metrics(st);
 		newroot->child[0] = st->root; // we only switched the pointer
 		newroot->spans[1] = splitsize;
+		newroot->metrics[1] = node_sum_metrics(split, node_fill(split, 0));
 		newroot->child[1] = split;
 		st->root = newroot;
 		st->levels++;
 	}
+	transient = 0;
+	tracking = NULL;
+	refresh_nodes();
 	return true;
 }
 
 /* deletion */
 
 static int delete_within_slice(struct node *leaf, int fill,
-								int i, size_t new_right_span, char *new_right)
+								int i, size_t new_right_span,
+								struct metrics new_right_metrics,
+								char *new_right)
 {
 	size_t *slice_span = &leaf->spans[i];
+	struct metrics *slice_metrics = &leaf->metrics[i];
 	char **data = (char **)&leaf->child[i];
 	size_t tmpspans[5];
+	struct metrics tmpmetrics[5];
 	char *tmp[5];
 	int tmpfill = 0;
 	if(i > 0) {
 		tmpspans[tmpfill] = leaf->spans[i-1];
+		tmpmetrics[tmpfill] = leaf->metrics[i-1];
 		tmp[tmpfill++] = leaf->child[i-1];
 	}
 	tmpspans[tmpfill] = *slice_span;
+	tmpmetrics[tmpfill] = *slice_metrics;
 	tmp[tmpfill++] = *data;
 	tmpspans[tmpfill] = new_right_span;
+	tmpmetrics[tmpfill] = new_right_metrics;
 	tmp[tmpfill++] = new_right;
 
 	if(i+1 < fill) {
 		tmpspans[tmpfill] = leaf->spans[i+1];
+		tmpmetrics[tmpfill] = leaf->metrics[i+1];
 		tmp[tmpfill++] = leaf->child[i+1];
 	}
 	// clearly we can create at most one extra slice
 	// unmergeable [L]*[L] -> [L]*[X]|[L] <=> full leaf +1 overflow
 	// delta == 0 means +1 for new_right being inserted
-	int newfill = merge_slices(tmpspans, tmp, tmpfill);
+	int newfill = merge_slices(tmpspans, tmpmetrics, tmp, tmpfill);
 	int delta = tmpfill - newfill;
 	assert(delta <= 3); // [S][S|S][S] -> [S]
 	int realfill = fill - (delta-1);
@@ -756,13 +1940,16 @@ static int delete_within_slice(struct node *leaf, int fill,
 		return B + 1;
 	st_dbg("merged %d nodes\n", delta);
 	if(i > 0) {
-		i--, slice_span--, data--; // see above
+		i--, slice_span--, slice_metrics--, data--; // see above
 	}
 	int count = fill - (i + (tmpfill-1)); // exclude new_right
 	memmove(slice_span + newfill, slice_span + (tmpfill-1),
 			count * sizeof(size_t));
+	memmove(slice_metrics + newfill, slice_metrics + (tmpfill-1),
+			count * sizeof(struct metrics));
 	memmove(data + newfill, data + (tmpfill-1), count * sizeof(char *));
 	memcpy(slice_span, tmpspans, newfill * sizeof(size_t));
+	memcpy(slice_metrics, tmpmetrics, newfill * sizeof(struct metrics));
 	memcpy(data, tmp, newfill * sizeof(char *));
 	if(delta > 0)
 		node_clrslots(leaf, realfill, fill);
@@ -773,8 +1960,9 @@ static int delete_within_slice(struct node *leaf, int fill,
 static long delete_leaf(struct node *leaf, size_t pos, long *span,
 						struct node **split, size_t *splitsize, void *ctx)
 {
-	int i = node_offset(leaf, &pos);
-	int fill = node_fill(leaf, i);
+	int i = node_search(leaf, &pos);
+	int fill = leaf->fill;
+	assert(fill == node_fill(leaf, 0));
 	// we search for pos + 1 as we assume our next chunk is in this leaf
 	pos--;
 	st_dbg("deletion: found slot %d, offset %zd, target fill %d\n",
@@ -786,15 +1974,24 @@ static long delete_leaf(struct node *leaf, size_t pos, long *span,
 		char *olddata = leaf->child[i];
 		size_t delta = -len;
 		size_t right_span = oldspan - pos - len;
+		struct metrics left_metrics = leaf->metrics[i];
+		struct metrics right_metrics = measure_range(olddata, oldspan,
+													left_metrics,
+													pos + len, oldspan);
+		metrics_sub(&left_metrics, right_metrics);
+		metrics_sub(&left_metrics, measure_range(olddata, oldspan,
+												leaf->metrics[i],
+												pos, pos + len));
 		char *right;
 		// copy right slice's data
 		if(right_span <= HIGH_WATER) {
-			right = malloc(HIGH_WATER);
+			right = small_new(right_span);
 			memcpy(right, olddata + pos + len, right_span);
 		} else
 			right = olddata + pos + len;
 		// truncate slice
 		leaf->spans[i] = pos;
+		leaf->metrics[i] = left_metrics;
 		// truncation might have resulted in a small block
 		bool truncated_large = oldspan > HIGH_WATER && pos <= HIGH_WATER;
 		if(truncated_large) {
@@ -802,17 +1999,18 @@ static long delete_leaf(struct node *leaf, size_t pos, long *span,
 			// assume userspace 0 bits, use high bit tag
 			leaf->child[i] = (void *)((uintptr_t)leaf->child[i] | 1ULL<<63);
 #else
-			char *new = malloc(HIGH_WATER);
+			char *new = small_new(pos);
 			memcpy(new, olddata, pos);
 			leaf->child[i] = new;
 #endif
 		}
-		int newfill = delete_within_slice(leaf, fill, i, right_span, right);
+		int newfill = delete_within_slice(leaf, fill, i, right_span,
+										right_metrics, right);
 #ifdef USETAGS
 		// untag and copy if not done already
 		// leaf(i) could not have shifted backwards unless it was merged
 		if(truncated_large && ((uintptr_t)leaf->child[i] >> 63)) {
-			char *new = malloc(HIGH_WATER);
+			char *new = small_new(leaf->spans[i]);
 			memcpy(new, (void *)((uintptr_t)leaf->child[i] <<1 >>1),
 					leaf->spans[i]);
 			leaf->child[i] = new;
@@ -835,8 +2033,11 @@ static long delete_leaf(struct node *leaf, size_t pos, long *span,
 			}
 			size_t n = fill - i;
 			memmove(&leaf->spans[i+1], &leaf->spans[i], n * sizeof(size_t));
+			memmove(&leaf->metrics[i+1], &leaf->metrics[i],
+					n * sizeof(struct metrics));
 			memmove(&leaf->child[i+1], &leaf->child[i], n * sizeof(char *));
 			leaf->spans[i] = right_span;
+			leaf->metrics[i] = right_metrics;
 			leaf->child[i] = right;
 		}
 		else if(newfill < B/2 + (B&1)) // underflow
@@ -846,9 +2047,12 @@ static long delete_leaf(struct node *leaf, size_t pos, long *span,
 		int start = i;
 		if(pos > 0) {
 			len -= leaf->spans[i] - pos; // no. deleted characters remaining
+			metrics_sub(&leaf->metrics[i],
+						measure_range(leaf->child[i], leaf->spans[i],
+									leaf->metrics[i], pos, leaf->spans[i]));
 			// may need to reallocate after truncation
 			if(leaf->spans[i] > HIGH_WATER && pos <= HIGH_WATER) {
-				char *new = malloc(HIGH_WATER);
+				char *new = small_new(pos);
 				memcpy(new, leaf->child[i], pos);
 				leaf->child[i] = new;
 			}
@@ -860,23 +2064,27 @@ static long delete_leaf(struct node *leaf, size_t pos, long *span,
 			char **se = (char **)&leaf->child[end];
 			// free small blocks
 			if(leaf->spans[end] <= HIGH_WATER) {
-				free(*se);
+				small_drop(*se);
 			}
 			len -= leaf->spans[end];
 			end++;
 		}
 		if(end < fill) { // if len == 0, st=end nothing happens. that's fine
 			char **se = (char **)&leaf->child[end];
+			metrics_sub(&leaf->metrics[end],
+						measure_range(*se, leaf->spans[end],
+									leaf->metrics[end], 0, len));
 			// delete prefix of end
 			if(leaf->spans[end] <= HIGH_WATER) {
+				small_reserve(se, leaf->spans[end], leaf->spans[end]);
 				block_delete(*se, leaf->spans[end], 0, len);
 				leaf->spans[end] -= len;
 			} else { // cannot become 0 as the loop would've continued
 				leaf->spans[end] -= len;
 				// was large, now small
 				if(leaf->spans[end] <= HIGH_WATER) {
-					char *new = malloc(HIGH_WATER);
-					memcpy(new, leaf->child[end], leaf->spans[end]);
+					char *new = small_new(leaf->spans[end]);
+					memcpy(new, (char *)leaf->child[end] + len, leaf->spans[end]);
 					leaf->child[end] = new;
 				} else
 					*se += len;
@@ -885,81 +2093,1255 @@ static long delete_leaf(struct node *leaf, size_t pos, long *span,
 		}
 		memmove(&leaf->spans[start], &leaf->spans[end],
 				(fill - end) * sizeof(size_t));
+		memmove(&leaf->metrics[start], &leaf->metrics[end],
+				(fill - end) * sizeof(struct metrics));
 		memmove(&leaf->child[start], &leaf->child[end],
 				(fill - end) * sizeof(char *));
 		int oldfill = fill;
 		fill = start + fill-end;
 		size_t tmpspans[5];
+		struct metrics tmpmetrics[5];
 		char *tmp[5];
 		// it's this simple! n.b. start may be truncated. Thus use start - 2
 		start = MAX(0, start - 2);
 		int tmpfill = MIN(fill - start, 4); // [][s|][|e][]
 		memcpy(tmpspans, &leaf->spans[start], tmpfill * sizeof(size_t));
+		memcpy(tmpmetrics, &leaf->metrics[start],
+				tmpfill * sizeof(struct metrics));
 		memcpy(tmp, &leaf->child[start], tmpfill * sizeof(char *));
 		// merge and copy in
-		int newfill = merge_slices(tmpspans, tmp, tmpfill);
+		int newfill = merge_slices(tmpspans, tmpmetrics, tmp, tmpfill);
 		st_dbg("merged %d nodes\n", tmpfill - newfill);
 		fill -= tmpfill - newfill;
 		memcpy(&leaf->spans[start], tmpspans, newfill * sizeof(size_t));
+		memcpy(&leaf->metrics[start], tmpmetrics,
+				newfill * sizeof(struct metrics));
 		memcpy(&leaf->child[start], tmp, newfill * sizeof(char *));
 		// move old entries down
 		memmove(&leaf->spans[start+newfill], &leaf->spans[start+tmpfill],
 				(oldfill - (start + tmpfill)) * sizeof(size_t));
+		memmove(&leaf->metrics[start+newfill], &leaf->metrics[start+tmpfill],
+				(oldfill - (start + tmpfill)) * sizeof(struct metrics));
 		memmove(&leaf->child[start+newfill], &leaf->child[start+tmpfill],
 				(oldfill - (start + tmpfill)) * sizeof(char *));
 		node_clrslots(leaf, fill, oldfill);
 
-		if(fill < B/2 + (B&1))
-			*splitsize = fill ? fill : ULONG_MAX; // ULONG_MAX indicates 0 size
-		return *span += len; // |requested - deleted| = |change|
+		if(fill < B/2 + (B&1))
+			*splitsize = fill ? fill : ULONG_MAX; // ULONG_MAX indicates 0 size
+		return *span += len; // |requested - deleted| = |change|
+	}
+}
+
+// whether [pos, pos + len) lies within a single leaf, in which case
+// delete_leaf handles it in one go
+static bool within_leaf(const SliceTable *st, size_t pos, size_t len)
+{
+	// search for the first and last bytes, as delete_leaf does
+	size_t first = pos + 1, last = pos + len;
+	const struct node *node = st->root;
+	for(int level = st->levels; level > 1; level--) {
+		int i = node_search(node, &first);
+		if(node_search(node, &last) != i)
+			return false;
+		node = node->child[i];
+	}
+	return true;
+}
+
+// removes [from, to) from the editable subtree at root. Children covered
+// whole are dropped and those at either end are cut recursively, leaving the
+// nodes along the cut possibly underfull. repair_seam handles those
+static void cut_range(struct node *root, int level, size_t from, size_t to)
+{
+	if(level == 1) { // only ever a prefix or suffix, so there is no split
+		long span = -(long)(to - from);
+		struct node *split = NULL;
+		size_t splitsize;
+		delete_leaf(root, from + 1, &span, &split, &splitsize, NULL);
+		assert(!split);
+		return;
+	}
+	int fill = root->fill;
+	assert(fill == node_fill(root, 0));
+	size_t first = from + 1, last = to;
+	int i = node_search(root, &first), j = node_search(root, &last);
+	first--; // from and to relative to children i and j
+	int lo = i, hi = j + 1; // children dropped whole
+	if(first > 0 || (i == j && last < root->spans[i])) {
+		size_t end = i == j ? last : root->spans[i];
+		ensure_node_editable((struct node **)&root->child[i], level - 1);
+		cut_range(root->child[i], level - 1, first, end);
+		root->spans[i] -= end - first;
+		root->metrics[i] = child_metrics(root, i);
+		lo++;
+	}
+	if(j > i && last < root->spans[j]) {
+		ensure_node_editable((struct node **)&root->child[j], level - 1);
+		cut_range(root->child[j], level - 1, 0, last);
+		root->spans[j] -= last;
+		root->metrics[j] = child_metrics(root, j);
+		hi--;
+	}
+	if(lo >= hi)
+		return;
+	for(int c = lo; c < hi; c++)
+		drop_node(root->child[c], level - 1);
+	size_t count = fill - hi;
+	memmove(&root->spans[lo], &root->spans[hi], count * sizeof(size_t));
+	memmove(&root->metrics[lo], &root->metrics[hi],
+			count * sizeof(struct metrics));
+	memmove(&root->child[lo], &root->child[hi], count * sizeof(void *));
+	node_clrslots(root, fill - (hi - lo), fill);
+}
+
+// returns an underfull child of root bordering on pos, or -1
+static int underfull_at(const struct node *root, size_t pos)
+{
+	size_t start = 0;
+	for(int i = 0; i < B && root->child[i] && start <= pos; i++) {
+		if(pos <= start + root->spans[i] &&
+				node_fill(root->child[i], 0) < B/2 + (B&1))
+			return i;
+		start += root->spans[i];
+	}
+	return -1;
+}
+
+// restores the fill of the nodes left underfull by cut_range, which all
+// border on pos. This is done top down so that any node we descend into has
+// been merged with its neighbours as necessary to have some of its own
+static void repair_seam(struct node *root, int level, size_t pos)
+{
+	if(level == 1)
+		return;
+	size_t splitsize;
+	int i;
+	if(level > 2)
+		while((i = underfull_at(root, pos)) >= 0 && node_fill(root, 0) > 1)
+			fix_underflow(root, level, i, node_fill(root->child[i], 0),
+						&splitsize);
+	if(level > 2) {
+		size_t start = 0;
+		for(i = 0; i < B && root->child[i] && start <= pos; i++) {
+			if(pos <= start + root->spans[i]) {
+				ensure_node_editable((struct node **)&root->child[i],
+									level - 1);
+				repair_seam(root->child[i], level - 1, pos - start);
+			}
+			start += root->spans[i];
+		}
+	}
+	// descending may have left them underfull again, and there are the
+	// leaves, whose neighbours are now in order
+	while((i = underfull_at(root, pos)) >= 0 && node_fill(root, 0) > 1)
+		fix_underflow(root, level, i, node_fill(root->child[i], 0),
+					&splitsize);
+}
+
+// whether any node bordering on pos below root is underfull
+static bool seam_underfull(const struct node *root, int level, size_t pos)
+{
+	if(level == 1)
+		return false;
+	if(underfull_at(root, pos) >= 0)
+		return true;
+	size_t start = 0;
+	for(int i = 0; i < B && root->child[i] && start <= pos; i++) {
+		if(pos <= start + root->spans[i] &&
+				seam_underfull(root->child[i], level - 1, pos - start))
+			return true;
+		start += root->spans[i];
+	}
+	return false;
+}
+
+// repairs the seam at pos of the tree at st. A root with a single child
+// can't merge the ones below it, which collapse_root brings up, so go again
+// until the seam holds
+static void repair_tree(SliceTable *st, size_t pos)
+{
+	do {
+		repair_seam(st->root, st->levels, pos);
+		collapse_root(st);
+	} while(seam_underfull(st->root, st->levels, pos));
+}
+
+// deletes a range spanning multiple leaves by cutting the tree along the
+// paths to both of its ends, then repairing those
+static void delete_range(SliceTable *st, size_t from, size_t to)
+{
+	if(from == 0 && to == st_size(st)) {
+		drop_node(st->root, st->levels);
+		st->root = new_node();
+		st->levels = 1;
+		return;
+	}
+	cut_range(st->root, st->levels, from, to);
+	collapse_root(st);
+	repair_tree(st, from);
+}
+
+bool st_delete(SliceTable *st, size_t pos, size_t len)
+{
+	if(pos + len > st_size(st))
+		return false;
+	if(len == 0)
+		return true;
+
+	st_dbg("st_delete at pos %zd of len %zd\n", pos, len);
+	record_edit(st, DELETE, pos, len);
+	track_edit(st, DELETE, pos, len);
+	move_marks(st, pos, len, 0, true);
+	transient = st->owner;
+	struct node *split = NULL;
+	size_t splitsize;
+	// we only need to ensure root uniqueness once
+	ensure_node_editable(&st->root, st->levels);
+
+	if(!within_leaf(st, pos, len)) {
+		delete_range(st, pos, pos + len);
+		transient = 0;
+		tracking = NULL;
+		refresh_nodes();
+		assert(st_check_invariants(st));
+		return true;
+	}
+	long remaining = -len;
+	// search for pos + 1 (see above)
+	// n.b. we never search for st_size+1 since that entails len = 0
+	edit_recurse(st, st->levels, st->root, pos+1, &remaining,
+				&delete_leaf, NULL, &split, &splitsize);
+	collapse_root(st);
+	// handle root split
+	if(split) {
+		st_dbg("allocating new root\n");
+		struct node *newroot = new_node();
+		newroot->spans[0] = st_size(st);
+		newroot->metrics[0] = root_metrics(st);
+		newroot->child[0] = st->root;
+		newroot->spans[1] = splitsize;
+		newroot->metrics[1] = node_sum_metrics(split, node_fill(split, 0));
+		newroot->child[1] = split;
+		st->root = newroot;
+		st->levels++;
+	}
+	transient = 0;
+	tracking = NULL;
+	refresh_nodes();
+	assert(st_check_invariants(st));
+	return true;
+}
+
+/* split and concatenation */
+
+static void extract_range(const SliceTable *st, size_t from, size_t to,
+						bool keep_blocks, SliceTable *out);
+
+bool st_split(const SliceTable *st, size_t pos,
+			SliceTable **left, SliceTable **right)
+{
+	size_t size = st_size(st);
+	if(pos > size)
+		return false;
+	assert(!st->owner && "transient tables must be persisted first");
+	// each keeps only the blocks it points into, so that a half of a mapped
+	// file doesn't pin the windows of the other
+	*left = new_table(NULL, 0, NULL);
+	*right = new_table(NULL, 0, NULL);
+	extract_range(st, 0, pos, false, *left);
+	extract_range(st, pos, size, false, *right);
+	refresh_nodes();
+	assert(st_check_invariants(*left) && st_check_invariants(*right));
+	return true;
+}
+
+// raises root by a level, as the single child of a new node
+static struct node *wrap_node(struct node *root)
+{
+	struct node *node = new_node();
+	int fill = node_fill(root, 0);
+	node->spans[0] = node_sum(root, fill);
+	node->metrics[0] = node_sum_metrics(root, fill);
+	node->child[0] = root;
+	return node;
+}
+
+SliceTable *st_concat(const SliceTable *a, const SliceTable *b)
+{
+	if(st_size(b) == 0)
+		return st_clone(a);
+	if(st_size(a) == 0)
+		return st_clone(b);
+	assert(!a->owner && !b->owner && "transient tables must be persisted first");
+
+	SliceTable *st = new_table(NULL, 0, merge_blocks(a->blocks, b->blocks));
+	// put both roots side by side under a new one, raising the lower with
+	// single child nodes. All that is underfull is along the seam then
+	struct node *left = a->root, *right = b->root;
+	incref(&left->refc);
+	incref(&right->refc);
+	st->levels = MAX(a->levels, b->levels);
+	for(int level = a->levels; level < st->levels; level++)
+		left = wrap_node(left);
+	for(int level = b->levels; level < st->levels; level++)
+		right = wrap_node(right);
+	st->root = wrap_node(left);
+	st->root->spans[1] = st_size(b);
+	st->root->metrics[1] = root_metrics(b);
+	st->root->child[1] = right;
+	st->levels++;
+
+	repair_tree(st, st_size(a));
+	refresh_nodes();
+	assert(st_check_invariants(st));
+	return st;
+}
+
+// builds [from, to) of the subtree at root. Nodes along the paths to either
+// end are new and may be underfull, while the subtrees and slices between
+// them are shared, as are large slices cut short that stay large
+static struct node *copy_range(const struct node *root, int level,
+							size_t from, size_t to)
+{
+	struct node *node = new_node();
+	int fill = root->fill, n = 0;
+	assert(fill == node_fill(root, 0));
+	size_t start = 0;
+	for(int i = 0; i < fill && start < to; start += root->spans[i++]) {
+		size_t span = root->spans[i];
+		if(start + span <= from)
+			continue;
+		size_t a = MAX(start, from) - start, b = MIN(start + span, to) - start;
+		node->spans[n] = b - a;
+		if(a == 0 && b == span) { // covered whole
+			node->metrics[n] = root->metrics[i];
+			node->child[n] = root->child[i];
+			if(level > 1)
+				incref(&((struct node *)root->child[i])->refc);
+			else if(span <= HIGH_WATER)
+				incref(&SMALL(root->child[i])->refc);
+		} else if(level > 1) {
+			node->child[n] = copy_range(root->child[i], level - 1, a, b);
+			node->metrics[n] = child_metrics(node, n);
+		} else {
+			char *data = root->child[i];
+			node->metrics[n] = measure_range(data, span, root->metrics[i],
+											a, b);
+			if(b - a > HIGH_WATER) // still points into the same block
+				node->child[n] = data + a;
+			else {
+				node->child[n] = small_new(b - a);
+				memcpy(node->child[n], data + a, b - a);
+			}
+		}
+		n++;
+	}
+	if(level == 1) { // slices cut short may fit together with a neighbour
+		int fill = merge_slices(node->spans, node->metrics,
+								(char **)node->child, n);
+		node_clrslots(node, fill, n);
+	}
+	return node;
+}
+
+static int compare_ptrs(const void *a, const void *b)
+{
+	const char *x = *(char *const *)a, *y = *(char *const *)b;
+	return (x > y) - (x < y);
+}
+
+static void large_slices(const struct node *root, int level,
+						const char ***ptrs, size_t *n, size_t *cap)
+{
+	int fill = node_fill(root, 0);
+	for(int i = 0; i < fill; i++) {
+		if(level > 1)
+			large_slices(root->child[i], level - 1, ptrs, n, cap);
+		else if(root->spans[i] > HIGH_WATER) {
+			if(*n == *cap) {
+				*cap = *cap ? 2 * *cap : 64;
+				*ptrs = realloc(*ptrs, *cap * sizeof **ptrs);
+			}
+			(*ptrs)[(*n)++] = root->child[i];
+		}
+	}
+}
+
+// the blocks of set that the large slices of st point into
+static struct blockset *used_blocks(const SliceTable *st,
+									struct blockset *set)
+{
+	if(!set || set->n == 0)
+		return NULL;
+	const char **ptrs = NULL;
+	size_t n = 0, cap = 0;
+	large_slices(st->root, st->levels, &ptrs, &n, &cap);
+	if(n == 0)
+		return NULL;
+	qsort(ptrs, n, sizeof *ptrs, compare_ptrs);
+	struct blockset *used = new_blockset(set->n);
+	for(int i = 0; i < set->n; i++) {
+		struct block *block = set->blocks[i];
+		// the first slice at or past the start of block
+		size_t lo = 0, hi = n;
+		while(lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if(ptrs[mid] < block->data)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(lo < n && within_block(block, ptrs[lo])) {
+			atomic_fetch_add_explicit(&block->refc, 1, memory_order_relaxed);
+			used->blocks[used->n++] = block; // stays sorted
+		}
+	}
+	free(ptrs);
+	if(used->n == set->n) {
+		drop_blocks(used);
+		return share_blocks(set);
+	}
+	return used;
+}
+
+// sets out to a tree of its own holding [from, to) of st, which shares all
+// but the paths to either end with it. Only the blocks it points into are
+// kept unless KEEP_BLOCKS
+static void extract_range(const SliceTable *st, size_t from, size_t to,
+						bool keep_blocks, SliceTable *out)
+{
+	if(from == to) {
+		out->root = new_node();
+		out->levels = 1;
+		out->blocks = NULL;
+		return;
+	}
+	out->levels = st->levels;
+	if(from == 0 && to == st_size(st)) {
+		incref(&st->root->refc);
+		out->root = st->root;
+		out->blocks = share_blocks(st->blocks);
+		return;
+	}
+	out->root = copy_range(st->root, st->levels, from, to);
+	collapse_root(out);
+	do { // repairing one end may take from the other when they are close
+		repair_tree(out, 0);
+		repair_tree(out, to - from);
+	} while(seam_underfull(out->root, out->levels, 0));
+	out->blocks = keep_blocks ? share_blocks(st->blocks) :
+		used_blocks(out, st->blocks);
+}
+
+// puts b after a, taking over the references of both to their trees
+static void join_trees(SliceTable *a, SliceTable *b)
+{
+	size_t seam = st_size(a);
+	struct node *left = a->root, *right = b->root;
+	int levels = MAX(a->levels, b->levels);
+	for(int level = a->levels; level < levels; level++)
+		left = wrap_node(left);
+	for(int level = b->levels; level < levels; level++)
+		right = wrap_node(right);
+	a->root = wrap_node(left);
+	a->root->spans[1] = st_size(b);
+	a->root->metrics[1] = root_metrics(b);
+	a->root->child[1] = right;
+	a->levels = levels + 1;
+	repair_tree(a, seam);
+	struct blockset *blocks = merge_blocks(a->blocks, b->blocks);
+	drop_blocks(a->blocks);
+	drop_blocks(b->blocks);
+	a->blocks = blocks;
+}
+
+bool st_insert_from(SliceTable *dst, size_t pos,
+					const SliceTable *src, size_t srcpos, size_t len)
+{
+	size_t srcsize = st_size(src), size = st_size(dst);
+	if(pos > size || srcpos > srcsize || len > srcsize - srcpos)
+		return false;
+	// its nodes would end up in dst, where the session would edit them inplace
+	if(src->owner && src != dst)
+		return false;
+	if(len == 0)
+		return true;
+	record_edit(dst, OTHER, pos, len);
+	track_edit(dst, OTHER, pos, len);
+	move_marks(dst, pos, 0, len, true);
+	// the range shares the nodes stamped so far
+	if(src == dst)
+		retire_token(dst);
+	transient = dst->owner;
+	// cut the range out of src and dst in two around pos, sharing all but
+	// the paths to the cuts, and join the three
+	SliceTable range, left, right;
+	extract_range(src, srcpos, srcpos + len, false, &range);
+	if(pos > 0) {
+		extract_range(dst, 0, pos, true, &left);
+		join_trees(&left, &range);
+	} else
+		left = range;
+	if(pos < size) {
+		extract_range(dst, pos, size, true, &right);
+		join_trees(&left, &right);
+	}
+	drop_node(dst->root, dst->levels);
+	drop_blocks(dst->blocks);
+	dst->root = left.root;
+	dst->levels = left.levels;
+	dst->blocks = left.blocks;
+	transient = 0;
+	tracking = NULL;
+	refresh_nodes();
+	assert(st_check_invariants(dst));
+	return true;
+}
+
+/* batched edits */
+
+// assembles leaves from a stream of slices, left to right. Slices are first
+// collected in slots, and small data is gathered in buf before becoming a
+// slot of its own. Finished leaves, either new or shared, go in leaves
+struct builder {
+	SliceTable *st; // for attaching new blocks
+	size_t spans[2*B];
+	struct metrics metrics[2*B];
+	void *child[2*B];
+	int fill;
+	char *buf;
+	size_t buflen;
+	struct metrics bufmetrics;
+	struct node **leaves;
+	size_t nleaves, cap;
+};
+
+static void build_add_leaf(struct builder *b, struct node *leaf)
+{
+	if(b->nleaves == b->cap) {
+		b->cap = b->cap ? 2 * b->cap : 16;
+		b->leaves = realloc(b->leaves, b->cap * sizeof(struct node *));
+	}
+	b->leaves[b->nleaves++] = leaf;
+}
+
+// moves the first count slots into a new leaf
+static void build_leaf(struct builder *b, int count)
+{
+	struct node *leaf = new_node();
+	memcpy(leaf->spans, b->spans, count * sizeof(size_t));
+	memcpy(leaf->metrics, b->metrics, count * sizeof(struct metrics));
+	memcpy(leaf->child, b->child, count * sizeof(void *));
+	b->fill -= count;
+	memmove(b->spans, &b->spans[count], b->fill * sizeof(size_t));
+	memmove(b->metrics, &b->metrics[count],
+			b->fill * sizeof(struct metrics));
+	memmove(b->child, &b->child[count], b->fill * sizeof(void *));
+	build_add_leaf(b, leaf);
+}
+
+static void build_push(struct builder *b, void *data, size_t span,
+						struct metrics m)
+{
+	b->spans[b->fill] = span;
+	b->metrics[b->fill] = m;
+	b->child[b->fill++] = data;
+	// keep B slots back so that the last leaf can't underflow
+	if(b->fill == 2*B)
+		build_leaf(b, B);
+}
+
+// turns buf into a slot
+static void build_flush(struct builder *b)
+{
+	if(b->buflen)
+		build_push(b, b->buf, b->buflen, b->bufmetrics);
+	b->buf = NULL;
+	b->buflen = 0;
+	b->bufmetrics = (struct metrics){ 0, 0 };
+}
+
+// adds a copy of small data. Small slices are only ended once the next one
+// can't fit, so that no two neighbouring slices can be merged
+static void build_append(struct builder *b, const char *data, size_t len,
+						struct metrics m)
+{
+	if(len == 0)
+		return;
+	if(b->buflen + len > HIGH_WATER)
+		build_flush(b);
+	if(!b->buf)
+		b->buf = small_new(len);
+	else
+		small_reserve(&b->buf, b->buflen, b->buflen + len);
+	memcpy(b->buf + b->buflen, data, len);
+	b->buflen += len;
+	metrics_add(&b->bufmetrics, m);
+}
+
+// adds the range [from, to) of a slice, pointing into it if large
+static void build_slice(struct builder *b, const char *data, size_t span,
+						struct metrics m, size_t from, size_t to)
+{
+	if(from == to)
+		return;
+	if(from > 0 || to < span)
+		m = measure_range(data, span, m, from, to);
+	if(to - from > HIGH_WATER) {
+		build_flush(b);
+		build_push(b, (char *)data + from, to - from, m);
+	} else
+		build_append(b, data + from, to - from, m);
+}
+
+// adds a copy of new data
+static void build_data(struct builder *b, const char *data, size_t len)
+{
+	if(len > HIGH_WATER) {
+		char *copy = malloc(len);
+		memcpy(copy, data, len);
+		add_block(b->st, new_block(HEAP, copy, len));
+		build_flush(b);
+		build_push(b, copy, len, measure(copy, len));
+	} else
+		build_append(b, data, len, measure(data, len));
+}
+
+// places all slots in one or two leaves, which must not underflow
+static void build_close(struct builder *b)
+{
+	if(b->fill > B)
+		build_leaf(b, b->fill / 2);
+	if(b->fill > 0)
+		build_leaf(b, b->fill);
+}
+
+// adds an existing leaf as is, unless the slots before it are too few for a
+// leaf of their own, in which case its slices are copied to make up the rest
+static void build_share(struct builder *b, struct node *leaf)
+{
+	int fill = node_fill(leaf, 0);
+	int slots = b->fill + (b->buflen > 0);
+	if(slots > 0 && slots < B/2 + (B&1)) {
+		for(int i = 0; i < fill; i++)
+			build_slice(b, leaf->child[i], leaf->spans[i], leaf->metrics[i],
+						0, leaf->spans[i]);
+		return;
+	}
+	build_flush(b);
+	build_close(b);
+	incref(&leaf->refc);
+	build_add_leaf(b, leaf);
+}
+
+static struct node *build_levels(struct node **nodes, size_t n, int *levels);
+
+// returns the finished tree. Trailing slots too few for a leaf are merged
+// with the previous leaf, copying it if shared
+static struct node *build_finish(struct builder *b, int *levels)
+{
+	build_flush(b);
+	if(b->fill > 0 && b->fill < B/2 + (B&1) && b->nleaves > 0) {
+		struct node *last = b->leaves[--b->nleaves];
+		int fill = node_fill(last, 0);
+		bool shared = !(transient && last->owner == transient) &&
+			atomic_load_explicit(&last->refc, memory_order_acquire) != 1;
+		memmove(&b->spans[fill], b->spans, b->fill * sizeof(size_t));
+		memmove(&b->metrics[fill], b->metrics,
+				b->fill * sizeof(struct metrics));
+		memmove(&b->child[fill], b->child, b->fill * sizeof(void *));
+		memcpy(b->spans, last->spans, fill * sizeof(size_t));
+		memcpy(b->metrics, last->metrics, fill * sizeof(struct metrics));
+		memcpy(b->child, last->child, fill * sizeof(void *));
+		b->fill += fill;
+		if(shared) {
+			for(int i = 0; i < fill; i++)
+				if(b->spans[i] <= HIGH_WATER)
+					incref(&SMALL(b->child[i])->refc);
+			drop_node(last, 1);
+		} else
+			free_node(last); // its slices moved over
+		b->fill = merge_slices(b->spans, b->metrics, (char **)b->child,
+							b->fill);
+	}
+	build_close(b);
+	return build_levels(b->leaves, b->nleaves, levels);
+}
+
+// builds the inner levels above nodes bottom up, spreading children evenly.
+// Takes ownership of the array
+static struct node *build_levels(struct node **nodes, size_t n, int *levels)
+{
+	*levels = 1;
+	if(n == 0) {
+		free(nodes);
+		return new_node();
+	}
+	for(; n > 1; ++*levels) {
+		size_t parents = (n + B - 1) / B, c = 0;
+		for(size_t p = 0; p < parents; p++) {
+			struct node *parent = new_node();
+			int fill = n / parents + (p < n % parents);
+			for(int i = 0; i < fill; i++, c++) {
+				struct node *child = nodes[c];
+				int childfill = node_fill(child, 0);
+				parent->spans[i] = node_sum(child, childfill);
+				parent->metrics[i] = node_sum_metrics(child, childfill);
+				parent->child[i] = child;
+			}
+			nodes[p] = parent;
+		}
+		n = parents;
+	}
+	struct node *root = nodes[0];
+	free(nodes);
+	return root;
+}
+
+struct batch {
+	struct builder build;
+	const SliceEdit *edits;
+	size_t n, next; // edits and the index of the next one to apply
+	size_t pos; // position of the current slice in the old document
+	size_t skip; // bytes left to delete
+};
+
+// cuts up the slices of a leaf touched by an edit, otherwise shares it
+static void batch_leaf(struct batch *b, struct node *leaf)
+{
+	int fill = node_fill(leaf, 0);
+	size_t end = b->pos + node_sum(leaf, fill);
+	if(fill == 0) // empty document
+		return;
+	if(!b->skip && (b->next == b->n || b->edits[b->next].pos >= end)) {
+		build_share(&b->build, leaf);
+		b->pos = end;
+		return;
+	}
+	for(int i = 0; i < fill; i++) {
+		const char *data = leaf->child[i];
+		size_t span = leaf->spans[i], off = 0;
+		while(off < span) {
+			if(b->skip) {
+				size_t len = MIN(b->skip, span - off);
+				off += len;
+				b->skip -= len;
+			} else if(b->next < b->n && b->edits[b->next].pos < b->pos+span) {
+				const SliceEdit *e = &b->edits[b->next++];
+				size_t to = e->pos - b->pos;
+				build_slice(&b->build, data, span, leaf->metrics[i], off, to);
+				build_data(&b->build, e->data, e->len);
+				off = to;
+				b->skip = e->del;
+			} else {
+				build_slice(&b->build, data, span, leaf->metrics[i], off, span);
+				off = span;
+			}
+		}
+		b->pos += span;
+	}
+}
+
+static void batch_recurse(struct batch *b, struct node *root, int level)
+{
+	if(level == 1)
+		batch_leaf(b, root);
+	else
+		for(int i = 0; i < node_fill(root, 0); i++)
+			batch_recurse(b, root->child[i], level - 1);
+}
+
+bool st_apply_batch(SliceTable *st, const SliceEdit *edits, size_t n)
+{
+	size_t size = st_size(st), end = 0;
+	for(size_t i = 0; i < n; i++) {
+		if(edits[i].pos < end || edits[i].pos + edits[i].del > size)
+			return false;
+		end = edits[i].pos + edits[i].del;
+	}
+	if(n == 0)
+		return true;
+
+	st_dbg("st_apply_batch of %zd edits\n", n);
+	record_edit(st, OTHER, 0, 0);
+	track_edit(st, OTHER, 0, 0);
+	// from the last, so that positions before each edit are still as given
+	for(size_t i = n; i-- > 0;)
+		move_marks(st, edits[i].pos, edits[i].del, edits[i].len, true);
+	transient = st->owner;
+	struct batch b = { .build = { .st = st }, .edits = edits, .n = n };
+	batch_recurse(&b, st->root, st->levels);
+	// what remains are insertions at the very end
+	for(; b.next < n; b.next++)
+		build_data(&b.build, edits[b.next].data, edits[b.next].len);
+	drop_node(st->root, st->levels);
+	st->root = build_finish(&b.build, &st->levels);
+	transient = 0;
+	refresh_nodes();
+	assert(st_check_invariants(st));
+	return true;
+}
+
+/* publishing */
+
+struct slicepublisher {
+	_Atomic(SliceTable *) current;
+	// readers between loading current and cloning it
+	atomic_int entering;
+	// replaced versions some reader may still be cloning, only ever touched
+	// by the writer
+	SliceTable **retired;
+	size_t nretired, retiredcap;
+};
+
+SlicePublisher *st_publisher_new(void)
+{
+	SlicePublisher *pub = malloc(sizeof *pub);
+	atomic_init(&pub->current, NULL);
+	atomic_init(&pub->entering, 0);
+	pub->retired = NULL;
+	pub->nretired = pub->retiredcap = 0;
+	return pub;
+}
+
+static void free_retired(SlicePublisher *pub)
+{
+	for(size_t i = 0; i < pub->nretired; i++)
+		st_free(pub->retired[i]);
+	pub->nretired = 0;
+}
+
+void st_publisher_free(SlicePublisher *pub)
+{
+	SliceTable *current = atomic_load(&pub->current);
+	if(current)
+		st_free(current);
+	free_retired(pub);
+	free(pub->retired);
+	free(pub);
+}
+
+void st_publish(SlicePublisher *pub, const SliceTable *st)
+{
+	SliceTable *old = atomic_exchange(&pub->current, st_clone(st));
+	if(old) {
+		if(pub->nretired == pub->retiredcap) {
+			pub->retiredcap = pub->retiredcap ? 2 * pub->retiredcap : 8;
+			pub->retired = realloc(pub->retired,
+								pub->retiredcap * sizeof *pub->retired);
+		}
+		pub->retired[pub->nretired++] = old;
+	}
+	// readers entering from here on see the new version. Once none are
+	// between loading and cloning, those that loaded a retired one are done
+	// with it. Otherwise they stay retired until a later publish
+	if(atomic_load(&pub->entering) == 0)
+		free_retired(pub);
+}
+
+SliceTable *st_snapshot_acquire(SlicePublisher *pub)
+{
+	atomic_fetch_add(&pub->entering, 1);
+	SliceTable *current = atomic_load(&pub->current);
+	SliceTable *snapshot = current ? st_clone(current) : NULL;
+	atomic_fetch_sub(&pub->entering, 1);
+	return snapshot;
+}
+
+void st_snapshot_release(SliceTable *snapshot)
+{
+	st_free(snapshot);
+}
+
+/* threads */
+
+struct parallel {
+	atomic_size_t next;
+	size_t n;
+	void (*fn)(void *ctx, size_t i);
+	void *ctx;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel *p = arg;
+	size_t i;
+	while((i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed))
+			< p->n)
+		p->fn(p->ctx, i);
+	return NULL;
+}
+
+// threads <= 0 means one per online cpu
+static int thread_count(int threads)
+{
+	return threads > 0 ? threads : MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+}
+
+// calls fn for each i in [0, n) on up to threads threads, the calling one
+// included
+static void run_parallel(size_t n, int threads,
+						void (*fn)(void *ctx, size_t i), void *ctx)
+{
+	threads = thread_count(threads);
+	if((size_t)threads > n)
+		threads = MAX(n, 1);
+	struct parallel p = { .n = n, .fn = fn, .ctx = ctx };
+	atomic_init(&p.next, 0);
+	pthread_t *tids = malloc((threads - 1) * sizeof *tids);
+	int started = 0;
+	// we can do with less threads if creating them fails
+	while(started < threads - 1 &&
+			!pthread_create(&tids[started], NULL, parallel_worker, &p))
+		started++;
+	parallel_worker(&p);
+	for(int i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+}
+
+/* parallel traversal */
+
+// start of the ith of n near equal parts of len
+static size_t part(size_t len, size_t n, size_t i)
+{
+	return i * (len / n) + MIN(i, len % n);
+}
+
+// documents are split into this many parts per thread, to even out the load
+#define PARTS_PER_THREAD 4
+// but parts are no smaller than this
+#define MIN_PART ((size_t)1 << 20)
+
+typedef void chunk_fn(const char *data, size_t len, size_t pos, void *ctx);
+
+// calls fn on the parts of slices under root that are within [from, to)
+static void walk_range(const struct node *root, int level, size_t pos,
+					size_t from, size_t to, chunk_fn *fn, void *ctx)
+{
+	for(int i = 0; i < root->fill && pos < to; i++) {
+		size_t end = pos + root->spans[i];
+		if(end > from) {
+			if(level > 1)
+				walk_range(root->child[i], level - 1, pos, from, to, fn, ctx);
+			else {
+				size_t start = MAX(pos, from);
+				fn((char *)root->child[i] + (start - pos),
+					MIN(end, to) - start, start, ctx);
+			}
+		}
+		pos = end;
+	}
+}
+
+struct parallel_walk {
+	const SliceTable *st;
+	size_t parts;
+	chunk_fn *fn;
+	void *ctx;
+	// for reductions, the accumulators of each part
+	char *accs;
+	size_t accsize;
+};
+
+static void walk_part(void *ctx, size_t i)
+{
+	struct parallel_walk *w = ctx;
+	size_t size = st_size(w->st);
+	walk_range(w->st->root, w->st->levels, 0, part(size, w->parts, i),
+				part(size, w->parts, i+1), w->fn,
+				w->accs ? w->accs + i*w->accsize : w->ctx);
+}
+
+static size_t count_parts(const SliceTable *st, int threads)
+{
+	size_t parts = (size_t)thread_count(threads) * PARTS_PER_THREAD;
+	return MAX(MIN(parts, st_size(st) / MIN_PART), 1);
+}
+
+void st_parallel_for_chunks(const SliceTable *st, int threads,
+		void (*fn)(const char *data, size_t len, size_t pos, void *ctx),
+		void *ctx)
+{
+	struct parallel_walk w = {
+		.st = st, .parts = count_parts(st, threads), .fn = fn, .ctx = ctx
+	};
+	run_parallel(w.parts, threads, walk_part, &w);
+}
+
+void st_parallel_reduce(const SliceTable *st, int threads,
+		void (*fn)(const char *data, size_t len, size_t pos, void *acc),
+		void (*merge)(void *result, const void *acc),
+		void *result, size_t size)
+{
+	struct parallel_walk w = {
+		.st = st, .parts = count_parts(st, threads), .fn = fn,
+		.accsize = size
+	};
+	w.accs = malloc(w.parts * size);
+	for(size_t i = 0; i < w.parts; i++)
+		memcpy(w.accs + i*size, result, size);
+	run_parallel(w.parts, threads, walk_part, &w);
+	for(size_t i = 0; i < w.parts; i++)
+		merge(result, w.accs + i*size);
+	free(w.accs);
+}
+
+/* loading */
+
+// files are measured in pieces of this size in parallel
+#define PIECE ((size_t)4 << 20)
+
+struct map_job {
+	char **windows;
+	size_t nwindows, len;
+	struct metrics *pieces;
+};
+
+static void measure_piece(void *ctx, size_t i)
+{
+	struct map_job *job = ctx;
+	size_t k = MIN(i * PIECE / WINDOW, job->nwindows - 1);
+	size_t off = i*PIECE - k*WINDOW, size = MIN(PIECE, job->len - i*PIECE);
+	job->pieces[i] = measure(job->windows[k] + off, size);
+	// done with it until the pages are read again, which keeps opening a
+	// file larger than memory from pushing out everything else
+	madvise(job->windows[k] + off, size, MADV_DONTNEED);
+}
+
+// maps fd in windows, each a slice and a block of its own. The last window
+// takes the remainder, so that none are small
+// The whole file is read once here, as every leaf and node holds the line
+// and codepoint counts of its slices. Opening costs a pass over the file,
+// but the pages don't stay resident
+static SliceTable *map_file(int fd, size_t len)
+{
+	size_t n = MAX(len / WINDOW, 1);
+	char **windows = malloc(n * sizeof *windows);
+	for(size_t k = 0; k < n; k++) {
+		size_t size = k == n-1 ? len - k*WINDOW : WINDOW;
+		windows[k] = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, k*WINDOW);
+		if(windows[k] == MAP_FAILED) {
+			while(k--)
+				munmap(windows[k], WINDOW);
+			free(windows);
+			close(fd);
+			return NULL;
+		}
+		// reading it once for the metrics
+		madvise(windows[k], size, MADV_SEQUENTIAL);
+	}
+	size_t npieces = (len + PIECE - 1) / PIECE;
+	struct map_job job = {
+		.windows = windows, .nwindows = n, .len = len,
+		.pieces = malloc(npieces * sizeof(struct metrics))
+	};
+	run_parallel(npieces, 0, measure_piece, &job);
+
+	SliceTable *st = new_table(NULL, 0, NULL);
+	struct builder b = { .st = st };
+	for(size_t k = 0, i = 0; k < n; k++) {
+		size_t size = k == n-1 ? len - k*WINDOW : WINDOW;
+		struct block *window = new_block(MMAP, windows[k], size);
+		// each has its own, as it may outlive the others
+		window->fd = k ? dup(fd) : fd;
+		window->offset = k*WINDOW;
+		add_block(st, window);
+		madvise(windows[k], size, MADV_NORMAL);
+		struct metrics m = { 0, 0 };
+		for(; i < npieces && i*PIECE < k*WINDOW + size; i++)
+			metrics_add(&m, job.pieces[i]);
+		build_push(&b, windows[k], size, m);
+	}
+	free(job.pieces);
+	free(windows);
+	st->root = build_finish(&b, &st->levels);
+	refresh_nodes();
+	return st;
+}
+
+struct load_job {
+	const char *const *chunks;
+	const size_t *offs; // of each chunk, with the total length last
+	size_t nchunks;
+	size_t nslices, nleaves;
+	struct node **leaves;
+};
+
+// copies [from, to) of the concatenated chunks to dest
+static void gather(const struct load_job *job, char *dest,
+					size_t from, size_t to)
+{
+	// find the last chunk starting at or before from
+	size_t lo = 0, hi = job->nchunks - 1;
+	while(lo < hi) {
+		size_t mid = (lo + hi + 1) / 2;
+		if(job->offs[mid] <= from)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	for(size_t c = lo; from < to; c++) {
+		size_t n = MIN(to, job->offs[c+1]) - from;
+		memcpy(dest, job->chunks[c] + (from - job->offs[c]), n);
+		dest += n;
+		from += n;
+	}
+}
+
+static void load_leaf(void *ctx, size_t k)
+{
+	struct load_job *job = ctx;
+	size_t len = job->offs[job->nchunks];
+	size_t first = part(job->nslices, job->nleaves, k);
+	int fill = part(job->nslices, job->nleaves, k+1) - first;
+	struct node *leaf = new_node();
+	for(int i = 0; i < fill; i++) {
+		size_t from = part(len, job->nslices, first + i);
+		size_t to = part(len, job->nslices, first + i + 1);
+		char *data = small_new(to - from);
+		gather(job, data, from, to);
+		leaf->spans[i] = to - from;
+		leaf->metrics[i] = measure(data, to - from);
+		leaf->child[i] = data;
+	}
+	job->leaves[k] = leaf;
+	refresh_nodes();
+}
+
+SliceTable *st_new_from_chunks(const char *const *chunks, const size_t *lens,
+							size_t n, int threads)
+{
+	size_t *offs = malloc((n + 1) * sizeof *offs);
+	offs[0] = 0;
+	for(size_t c = 0; c < n; c++)
+		offs[c+1] = offs[c] + lens[c];
+	size_t len = offs[n];
+	if(len == 0) {
+		free(offs);
+		return st_new();
+	}
+	// the fewest slices that fit, evenly sized so that neighbours can't be
+	// merged, and the fewest leaves to hold them, evenly filled
+	size_t nslices = (len + HIGH_WATER - 1) / HIGH_WATER;
+	struct load_job job = {
+		.chunks = chunks, .offs = offs, .nchunks = n, .nslices = nslices,
+		.nleaves = (nslices + B - 1) / B
+	};
+	job.leaves = malloc(job.nleaves * sizeof(struct node *));
+	run_parallel(job.nleaves, threads, load_leaf, &job);
+	free(offs);
+
+	int levels;
+	struct node *root = build_levels(job.leaves, job.nleaves, &levels);
+	refresh_nodes();
+	return new_table(root, levels, NULL);
+}
+
+SliceTable *st_new_from_buffer(const char *data, size_t len, int threads)
+{
+	return st_new_from_chunks(&data, &len, 1, threads);
+}
+
+static void release_block(const struct block *block, void *ctx)
+{
+	(void)ctx;
+	if(block->type == MMAP)
+		madvise(block->data, block->len, MADV_DONTNEED);
+}
+
+void st_release_pages(const SliceTable *st)
+{
+	walk_blocks(st->blocks, release_block, NULL);
+}
+
+/* line and codepoint indexing */
+
+enum metric { LINES, CPS };
+
+static size_t metric(struct metrics m, enum metric kind)
+{
+	return kind == LINES ? m.lines : m.cps;
+}
+
+// returns the metrics of [0, pos)
+static struct metrics pos_to_metrics(const SliceTable *st, size_t pos)
+{
+	struct metrics m = { 0, 0 };
+	struct node *node = st->root;
+	for(int level = st->levels; level > 1; level--) {
+		int i = node_search(node, &pos);
+		for(int j = 0; j < i; j++)
+			metrics_add(&m, node->metrics[j]);
+		node = node->child[i];
+	}
+	// a leaf is never empty except for the empty document
+	if(pos == 0)
+		return m;
+	int i = node_search(node, &pos);
+	for(int j = 0; j < i; j++)
+		metrics_add(&m, node->metrics[j]);
+	metrics_add(&m, measure_range(node->child[i], node->spans[i],
+								node->metrics[i], 0, pos));
+	return m;
+}
+
+// returns the position of the nth (from 1) unit of KIND
+static size_t metric_to_pos(const SliceTable *st, enum metric kind, size_t n)
+{
+	size_t pos = 0;
+	struct node *node = st->root;
+	for(int level = st->levels; level >= 1; level--) {
+		int i = 0;
+		while(n > metric(node->metrics[i], kind)) {
+			n -= metric(node->metrics[i], kind);
+			pos += node->spans[i++];
+		}
+		if(level == 1) {
+			const char *data = node->child[i], *end = data + node->spans[i];
+			const char *s = data;
+			size_t total = metric(node->metrics[i], kind);
+			// count from whichever end of the slice is nearer
+			if(kind == CPS && n > total / 2) {
+				n = total - n + 1;
+				s = cp_rfind(s, end, &n);
+			} else if(kind == CPS)
+				s = cp_find(s, end, &n);
+			else if(n > total / 2) {
+				n = total - n + 1;
+				s = byte_rfind(s, end, '\n');
+				while(--n > 0)
+					s = byte_rfind(data, s, '\n');
+			} else
+				while((s = byte_find(s, end, '\n')) && --n > 0)
+					s++;
+			return pos + (s - data);
+		}
+		node = node->child[i];
 	}
+	return pos;
 }
 
-bool st_delete(SliceTable *st, size_t pos, size_t len)
+size_t st_pos_to_line(const SliceTable *st, size_t pos)
 {
-	if(pos + len > st_size(st))
-		return false;
-	if(len == 0)
-		return true;
+	return pos_to_metrics(st, pos).lines;
+}
 
-	st_dbg("st_delete at pos %zd of len %zd\n", pos, len);
-	struct node *split = NULL;
-	size_t splitsize;
-	// we only need to ensure root uniqueness once
-	ensure_node_editable(&st->root, st->levels);
+size_t st_line_to_pos(const SliceTable *st, size_t line)
+{
+	return line ? metric_to_pos(st, LINES, line) + 1 : 0;
+}
 
-	do {
-		long remaining = -len;
-		// n.b. remaining is bytes left to delete.
-		st_dbg("deleting... %ld bytes remaining\n", remaining);
-		// search for pos + 1 (see above)
-		// n.b. we never search for st_size+1 since that entails len = 0
-		edit_recurse(st, st->levels, st->root, pos+1, &remaining,
-					&delete_leaf, NULL, &split, &splitsize);
-		len += remaining; // adjusted to byte delta (e.g. -3)
-		// handle underflow
-		if(st->levels > 1 && node_fill(st->root, 0) == 1) {
-			st_dbg("handling root underflow\n");
-			struct node *oldroot = st->root;
-			st->root = st->root->child[0];
-			free(oldroot);
-			st->levels--;
-		}
-		// handle root split
-		if(split) {
-			st_dbg("allocating new root\n");
-			struct node *newroot = new_node();
-			newroot->spans[0] = st_size(st);
-			newroot->child[0] = st->root;
-			newroot->spans[1] = splitsize;
-			newroot->child[1] = split;
-			st->root = newroot;
-			st->levels++;
-		}
-		assert(st_check_invariants(st));
-	} while(len > 0);
+size_t st_byte_to_cp(const SliceTable *st, size_t pos)
+{
+	return pos_to_metrics(st, pos).cps;
+}
 
-	return true;
+size_t st_cp_to_byte(const SliceTable *st, size_t cp)
+{
+	if(cp == st_codepoints(st))
+		return st_size(st);
+	return metric_to_pos(st, CPS, cp + 1);
 }
 
 /* iterator */
@@ -969,7 +3351,9 @@ struct stackentry {
 	int idx;
 };
 
-#define STACKSIZE 3
+// levels of the path kept in the iterator itself, deeper trees put it on the
+// heap
+#define STACKSIZE 6
 struct sliceiter {
 	size_t span; // span of current slice
 	size_t off; // offset into slice
@@ -977,53 +3361,162 @@ struct sliceiter {
 	size_t pos; // absolute position
 	struct node *leaf;
 	int node_offset;
+	// the path from the root down to the leaf, which has the parent of the
+	// leaf at index 0. In stack, or in heap once the tree is deeper
 	struct stackentry stack[STACKSIZE];
+	struct stackentry *heap;
+	int heapsize;
+	// set when st_iter_refresh kept the leaf but not the path above it, which
+	// is searched again when leaving the leaf
+	bool lost_path;
+	// version of st the iterator was positioned in
+	unsigned long version;
 	SliceTable *st;
 };
 
-SliceIter *st_iter_to(SliceIter *it, size_t pos)
+static struct stackentry *iter_path(SliceIter *it)
 {
-	it->pos = pos;
-	// TODO having 2 exceptions is quite ugly
-	size_t size = st_size(it->st);
-	bool off_end = (pos == size);
-	if(pos > 0)
-		pos -= off_end;
+	return it->heap ? it->heap : it->stack;
+}
+
+#ifndef NDEBUG
+// debug builds assert this on each use of an iterator
+static bool iter_current(const SliceIter *it)
+{
+	if(it->version == it->st->version)
+		return true;
+	st_dbg("iterator used after an edit, see st_iter_refresh\n");
+	return false;
+}
+#endif
 
-	struct node *node = it->st->root;
-	int level = it->st->levels;
+// descends from node, at level, to the slice holding the byte before key,
+// recording the path. This leaves it->data to the caller
+static void iter_descend(SliceIter *it, struct node *node, int level,
+						size_t key)
+{
+	struct stackentry *path = iter_path(it);
 	while(level > 1) {
-		int i = 0;
-		while(pos && pos >= node->spans[i])
-			pos -= node->spans[i++];
+		int i = node_search(node, &key);
 		st_dbg("iter_to: found i: %d at level %d\n", i, level);
-		int stackidx = level - 2; // level 2 goes at stack[0], etc.
-		if(stackidx < STACKSIZE)
-			it->stack[stackidx] = (struct stackentry){ node, i };
+		// level 2 goes at path[0], etc.
+		path[level - 2] = (struct stackentry){ node, i };
 
 		node = node->child[i];
 		level--;
 	}
-	struct node *leaf = (struct node *)node;
-	it->leaf = leaf;
+	it->leaf = node;
 	// find position within leaf
-	int i = 0;
-	while(pos && pos >= leaf->spans[i])
-		pos -= leaf->spans[i++];
-
+	int i = node_search(node, &key);
 	it->node_offset = i;
-	it->span = leaf->spans[i];
-	it->off = pos;
-	st_dbg("iter_to at leaf: i: %d, pos %zd\n", i, pos);
+	it->span = node->spans[i];
+	it->off = key - 1;
+	st_dbg("iter_to at leaf: i: %d, pos %zd\n", i, it->off);
+}
+
+SliceIter *st_iter_to(SliceIter *it, size_t pos)
+{
+	it->pos = pos;
+	// TODO having 2 exceptions is quite ugly
+	size_t size = st_size(it->st);
+	bool off_end = (pos == size);
+	if(pos > 0)
+		pos -= off_end;
+
+	int depth = it->st->levels - 1;
+	if(depth > STACKSIZE && depth > it->heapsize) {
+		it->heap = realloc(it->heap, depth * sizeof *it->heap);
+		it->heapsize = depth;
+	}
+	// searching for pos + 1 finds the slice containing pos rather than one
+	// ending at it
+	iter_descend(it, it->st->root, it->st->levels, pos + 1);
+	it->lost_path = false;
+	it->version = it->st->version;
 
 	if(size > 0) {
-		it->data = (char *)leaf->child[i] + pos;
+		it->data = (char *)it->leaf->child[it->node_offset] + it->off;
 		// we searched for pos - 1
 		if(off_end) {
 			it->data++;
 			it->off++;
 		}
+	} else { // empty document, always off-end
+		it->span = it->off = 0;
+		it->data = NULL;
+	}
+	return it;
+}
+
+// climbs the path only as far as the lowest node holding the target, so
+// that nearby seeks cost less than searching from the root
+SliceIter *st_iter_seek_rel(SliceIter *it, long delta)
+{
+	assert(iter_current(it));
+	size_t pos = it->pos + delta;
+	// start of the current slice, which is kept unless pos is past it
+	size_t start = it->pos - it->off;
+	if(pos >= start && pos - start < it->span) {
+		it->off = pos - start;
+		it->data = (char *)it->leaf->child[it->node_offset] + it->off;
+		it->pos = pos;
+		return it;
+	}
+	// off-end, as st_iter_to places it
+	if(pos >= st_size(it->st) || it->lost_path)
+		return st_iter_to(it, pos);
+
+	struct stackentry *path = iter_path(it);
+	struct node *node = it->leaf;
+	int level = 1;
+	start -= it->node_offset ? node->ends[it->node_offset - 1] : 0;
+	// the root holds every pos before the end
+	while(pos < start || pos - start >= node->ends[node->fill - 1]) {
+		struct stackentry *parent = &path[level - 1];
+		start -= parent->idx ? parent->node->ends[parent->idx - 1] : 0;
+		node = parent->node;
+		level++;
 	}
+	iter_descend(it, node, level, pos - start + 1);
+	it->data = (char *)it->leaf->child[it->node_offset] + it->off;
+	it->pos = pos;
+	return it;
+}
+
+// an edit leaves a leaf alone unless it is among the nodes it touched or
+// overlaps the deleted range, as whole subtrees are dropped by reference
+static bool iter_leaf_kept(const SliceIter *it, const struct lastedit *e)
+{
+	for(size_t k = 0; k < e->n; k++)
+		if(e->nodes[k] == it->leaf)
+			return false;
+	const struct node *leaf = it->leaf;
+	int i = it->node_offset;
+	size_t start = it->pos - it->off - (i ? leaf->ends[i-1] : 0);
+	size_t end = start + leaf->ends[leaf->fill - 1];
+	return !e->del || e->pos + e->del <= start || e->pos >= end;
+}
+
+SliceIter *st_iter_refresh(SliceIter *it)
+{
+	const SliceTable *st = it->st;
+	if(it->version == st->version)
+		return it;
+	const struct lastedit *e = st->last;
+	if(!e->known || it->version + 1 != st->version)
+		return st_iter_to(it, MIN(it->pos, st_size(st)));
+
+	// the byte it was on moves with the edit, or to its end if deleted
+	size_t pos = it->pos;
+	if(pos >= e->pos + e->del)
+		pos = pos - e->del + e->len;
+	else if(pos > e->pos)
+		pos = e->pos + e->len;
+	if(!iter_leaf_kept(it, e))
+		return st_iter_to(it, pos);
+	it->pos = pos;
+	it->lost_path = true;
+	it->version = st->version;
 	return it;
 }
 
@@ -1031,18 +3524,21 @@ SliceIter *st_iter_new(SliceTable *st, size_t pos)
 {
 	SliceIter *it = malloc(sizeof *it);
 	it->st = st;
+	it->heap = NULL;
+	it->heapsize = 0;
 	return st_iter_to(it, pos);
 }
 
 int iter_stacksize(SliceIter *it)
 {
-	return MIN(it->st->levels - 1, STACKSIZE);
+	return it->st->levels - 1;
 }
 
 void st_iter_free(SliceIter *it)
 {
 	// We shouldn't have to manage reference counting of nodes given the
 	// invalidation upon freeing/modification of the corresponding slicetable.
+	free(it->heap);
 	free(it);
 }
 
@@ -1056,38 +3552,43 @@ static bool iter_off_end(const SliceIter *it)
 
 bool st_iter_next_chunk(SliceIter *it)
 {
+	assert(iter_current(it));
 	int i = it->node_offset;
 	struct node *leaf = it->leaf;
 	it->pos += leaf->spans[i] - it->off;
 	// fast path: same leaf
-	if(i < B-1 && leaf->spans[i+1] != ULONG_MAX) {
+	if(i + 1 < leaf->fill) {
 		it->node_offset++;
 		it->span = leaf->spans[i+1];
 		it->off = 0;
 		it->data = leaf->child[i+1];
 		return true;
 	}
-	int si = 0;
-	struct stackentry *s = &it->stack[si];
-	while(si < iter_stacksize(it) && s->idx < B-1 &&
-			s->node->spans[s->idx+1] == ULONG_MAX)
-		s++, si++;
+	if(it->lost_path) {
+		st_iter_to(it, it->pos);
+		return !iter_off_end(it);
+	}
+	// find the lowest ancestor with a next sibling
+	struct stackentry *path = iter_path(it);
+	int si = 0, depth = iter_stacksize(it);
+	while(si < depth && path[si].idx + 1 == path[si].node->fill)
+		si++;
 	// first condition fails if off-end
-	if(si != iter_stacksize(it)) {
-		it->stack[si].idx++;
-		while(--si > 0) {
-			it->stack[si].node = it->stack[si+1].node->child[0];
-			it->stack[si].idx = 0;
+	if(si != depth) {
+		path[si].idx++;
+		// then descend along the leftmost path
+		while(--si >= 0) {
+			struct stackentry *parent = &path[si+1];
+			path[si].node = parent->node->child[parent->idx];
+			path[si].idx = 0;
 		}
-		int leaf_idx = it->stack[0].idx;
-		it->leaf = (struct node *)it->stack[0].node->child[leaf_idx];
+		it->leaf = (struct node *)path[0].node->child[path[0].idx];
 		it->node_offset = 0;
 		it->span = it->leaf->spans[0];
 		it->off = 0;
 		it->data = it->leaf->child[0];
 		return true;
-	} else { // if the stack was insufficient, search from the root
-		st_dbg("gave up. scanning from root for %zd\n", it->pos);
+	} else { // past the last slice
 		st_iter_to(it, it->pos);
 		return !iter_off_end(it);
 	}
@@ -1095,63 +3596,72 @@ bool st_iter_next_chunk(SliceIter *it)
 
 bool st_iter_prev_chunk(SliceIter *it)
 {
+	assert(iter_current(it));
 	int i = it->node_offset;
 	struct node *leaf = it->leaf;
+	size_t off = it->off;
 	// fast path: same leaf
 	if(i > 0) {
 		it->node_offset--;
 		it->span = it->leaf->spans[i-1];
 		it->off = it->span - 1;
 		it->data = (char *)leaf->child[i-1] + it->off;
-		it->pos -= it->off + 1;
+		it->pos -= off + 1;
+		return true;
+	}
+	if(it->lost_path) {
+		if(it->pos == it->off) { // on the first slice
+			st_iter_to(it, 0);
+			return false;
+		}
+		st_iter_to(it, it->pos - it->off - 1);
 		return true;
 	}
-	int si = 0;
-	struct stackentry *s = &it->stack[si];
-	while(si < iter_stacksize(it) && s->idx == 0)
-		s++, si++;
-
-	if(si != iter_stacksize(it)) {
-		it->stack[si].idx--;
-		while(--si > 0) {
-			struct node *parent = it->stack[si+1].node;
-			int parentfill = node_fill(parent, 0);
-			it->stack[si].node = parent->child[parentfill-1];
-			int fill = node_fill(it->stack[si].node, 0);
-			it->stack[si].idx = fill - 1;
+	// find the lowest ancestor with a previous sibling
+	struct stackentry *path = iter_path(it);
+	int si = 0, depth = iter_stacksize(it);
+	while(si < depth && path[si].idx == 0)
+		si++;
+
+	if(si != depth) {
+		path[si].idx--;
+		// then descend along the rightmost path
+		while(--si >= 0) {
+			struct stackentry *parent = &path[si+1];
+			path[si].node = parent->node->child[parent->idx];
+			path[si].idx = path[si].node->fill - 1;
 		}
-		int leaf_i = it->stack[0].idx;
-		struct node *leaf = (struct node *)it->stack[0].node->child[leaf_i];
-		int fill = node_fill(leaf, 0);
+		struct node *leaf = (struct node *)path[0].node->child[path[0].idx];
+		int fill = leaf->fill;
 		it->leaf = leaf;
 		it->node_offset = fill - 1;
 		it->span = leaf->spans[fill-1];
 		it->off = it->span - 1;
 		it->data = (char *)leaf->child[fill-1] + it->off;
+		it->pos -= off + 1;
 		return true;
-	} else { // if stack was insufficient, reinitialize
-		if(it->pos == it->off) // we're on the first chunk already
-			st_iter_to(it, 0);
-		else
-			st_iter_to(it, it->pos - it->off - 1);
-		return it->pos > 0;
+	} else { // on the first slice
+		st_iter_to(it, 0);
+		return false;
 	}
-	return true;
 }
 
 char *st_iter_chunk(const SliceIter *it, size_t *len)
 {
+	assert(iter_current(it));
 	*len = it->span;
 	return it->data - it->off;
 }
 
 char st_iter_byte(const SliceIter *it)
 {
+	assert(iter_current(it));
 	return iter_off_end(it) ? -1 : it->data[0];
 }
 
 char st_iter_next_byte(SliceIter *it, size_t count)
 {
+	assert(iter_current(it));
 	if(iter_off_end(it))
 		return -1;
 
@@ -1169,6 +3679,7 @@ char st_iter_next_byte(SliceIter *it, size_t count)
 
 char st_iter_prev_byte(SliceIter *it, size_t count)
 {
+	assert(iter_current(it));
 	if(it->pos == 0)
 		return -1;
 
@@ -1184,53 +3695,341 @@ char st_iter_prev_byte(SliceIter *it, size_t count)
 	return st_iter_prev_byte(it, count - left);
 }
 
-// Assume utf-8
-// Assume that codepoints are not split across leaf boundaries
-// if this occurs, it means the user has already corrupted the file,
-// which should not be allowed. We never redistribute leaves, only merge
+// metrics of the current slice
+static struct metrics iter_slice_metrics(const SliceIter *it)
+{
+	return it->leaf->metrics[it->node_offset];
+}
+
+// Assume utf-8. Codepoints may straddle slices as edits can split them
+// anywhere, in which case we gather the bytes with a temporary iterator
 long st_iter_cp(const SliceIter *it)
 {
-	static const char utf8_len[] = {
+	assert(iter_current(it));
+	static const unsigned char utf8_len[] = {
 		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
 		0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 0
 	};
-	static const char utf8_lead_masks[] = { 0, 0xFF, 0x1F, 0xF, 0x7 };
+	static const unsigned char utf8_lead_masks[] = { 0, 0x7F, 0x1F, 0xF, 0x7 };
+	// smallest codepoint of each length, anything below is overlong
+	static const long utf8_min[] = { 0, 0, 0x80, 0x800, 0x10000 };
 	// in any other case the iterator points into data
 	if(iter_off_end(it))
 		return -1;
-	char lead = *it->data;
-	unsigned char len = utf8_len[lead >> 3];
-	if(len < it->span - it->off)
+	if((unsigned char)*it->data < 0x80)
+		return *it->data;
+	unsigned char bytes[4];
+	bytes[0] = *it->data;
+	unsigned char len = utf8_len[bytes[0] >> 3];
+	if(len == 0 || len > sizeof bytes)
 		return -1;
+	if(len <= it->span - it->off)
+		memcpy(bytes, it->data, len);
+	else { // the copy needs a path of its own to step along
+		SliceIter tmp = *it;
+		if(it->heap) {
+			tmp.heap = malloc(it->heapsize * sizeof *it->heap);
+			memcpy(tmp.heap, it->heap, it->heapsize * sizeof *it->heap);
+		}
+		bool truncated = false;
+		for(unsigned char i = 1; i < len && !truncated; i++) {
+			bytes[i] = st_iter_next_byte(&tmp, 1);
+			// at the end of the document
+			truncated = iter_off_end(&tmp);
+		}
+		free(tmp.heap);
+		if(truncated)
+			return -1;
+	}
 
-	long cp = lead & utf8_lead_masks[len];
-	for(unsigned char i = 1; i < len; i++)
-		cp = cp<<6 | (it->data[i] & 0x3F);
+	long cp = bytes[0] & utf8_lead_masks[len];
+	for(unsigned char i = 1; i < len; i++) {
+		if(utf8_lead(bytes[i]))
+			return -1;
+		cp = cp<<6 | (bytes[i] & 0x3F);
+	}
+	if(cp < utf8_min[len] || (cp >= 0xD800 && cp <= 0xDFFF))
+		return -1;
 	return cp <= 0x10FFFF ? cp : -1;
 }
 
-// skip over non-leading bytes
+// moves to the start of the countth next codepoint. Whole slices are skipped
+// using their codepoint counts and others are scanned for leading bytes
 long st_iter_next_cp(SliceIter *it, size_t count)
 {
-	// leading
-	if((*it->data & 0xC0) != 0x80)
-		;
-	return st_iter_cp(it);
+	assert(iter_current(it));
+	if(count == 0)
+		return st_iter_cp(it);
+	if(iter_off_end(it))
+		return -1;
+	// short moves within the slice are cheaper to scan bytewise
+	size_t left = MIN(it->span - it->off, 16), n = count;
+	for(size_t i = 1; i < left; i++)
+		if(utf8_lead(it->data[i]) && --n == 0) {
+			st_iter_next_byte(it, i);
+			return st_iter_cp(it);
+		}
+	// then find the countth leading byte from the next byte onwards
+	st_iter_next_byte(it, 1);
+	while(!iter_off_end(it)) {
+		const char *end = it->data + (it->span - it->off);
+		if(it->off == 0 && iter_slice_metrics(it).cps < count) {
+			count -= iter_slice_metrics(it).cps;
+			st_iter_next_chunk(it);
+			continue;
+		}
+		const char *cp = cp_find(it->data, end, &count);
+		if(cp) {
+			st_iter_next_byte(it, cp - it->data);
+			return st_iter_cp(it);
+		}
+		st_iter_next_chunk(it);
+	}
+	return -1;
 }
 
 long st_iter_prev_cp(SliceIter *it, size_t count)
 {
-	return st_iter_cp(it);
+	assert(iter_current(it));
+	if(count == 0)
+		return st_iter_cp(it);
+	// bytes before the cursor in the current slice
+	const char *end = it->data;
+	while(true) {
+		const char *start = it->data - it->off;
+		if(end == start + it->span && iter_slice_metrics(it).cps < count)
+			count -= iter_slice_metrics(it).cps;
+		else {
+			const char *cp = cp_rfind(start, end, &count);
+			if(cp) {
+				st_iter_prev_byte(it, it->data - cp);
+				return st_iter_cp(it);
+			}
+		}
+		if(it->pos == it->off) // first slice
+			break;
+		st_iter_prev_chunk(it);
+		end = it->data + 1;
+	}
+	st_iter_to(it, 0);
+	return -1;
 }
 
+// moves to the start of the countth next line, or the end of the document
 bool st_iter_next_line(SliceIter *it, size_t count)
 {
-	;
+	assert(iter_current(it));
+	if(count == 0)
+		return true;
+	while(!iter_off_end(it)) {
+		const char *end = it->data + (it->span - it->off);
+		// skip whole slices where possible
+		if(it->off == 0 && iter_slice_metrics(it).lines < count) {
+			count -= iter_slice_metrics(it).lines;
+			st_iter_next_chunk(it);
+			continue;
+		}
+		const char *nl = it->data;
+		while((nl = byte_find(nl, end, '\n')) && --count > 0)
+			nl++;
+		if(nl) {
+			st_iter_next_byte(it, nl+1 - it->data);
+			return true;
+		}
+		st_iter_next_chunk(it);
+	}
+	return false;
 }
 
+// moves to the start of the countth previous line, or the start of the
+// document. When count is 0 this moves to the start of the current line
 bool st_iter_prev_line(SliceIter *it, size_t count)
 {
-	;
+	assert(iter_current(it));
+	// we want to end up just after the (count+1)th newline behind us
+	count++;
+	// bytes before the cursor in the current slice
+	const char *end = it->data;
+	while(true) {
+		const char *start = it->data - it->off;
+		if(end == start + it->span && iter_slice_metrics(it).lines < count)
+			count -= iter_slice_metrics(it).lines;
+		else {
+			const char *nl = end;
+			while((nl = byte_rfind(start, nl, '\n')) && --count > 0)
+				;
+			if(nl) {
+				if(nl+1 == start + it->span)
+					st_iter_next_chunk(it);
+				else
+					st_iter_prev_byte(it, it->data - (nl+1));
+				return true;
+			}
+		}
+		if(it->pos == it->off) // first slice
+			break;
+		st_iter_prev_chunk(it);
+		end = it->data + 1;
+	}
+	st_iter_to(it, 0);
+	return count == 1;
+}
+
+/* search */
+
+// matches are looked for within each slice, and across the seam with the
+// text searched before it. buf keeps the len - 1 bytes of that text next to
+// the seam, followed (preceded when searching backwards) by as many of the
+// slice's, which is all a match across the seam can cover
+struct search {
+	const char *needle;
+	size_t len;
+	char *buf;
+	size_t seam; // bytes of buf from the text searched before
+	bool all;
+	// matches starting before this are skipped, so that they don't overlap
+	size_t next;
+	size_t *found, n, cap;
+};
+
+static void search_init(struct search *s, const char *needle, size_t len,
+						bool all)
+{
+	*s = (struct search){
+		.needle = needle, .len = len, .buf = malloc(2 * len), .all = all
+	};
+}
+
+static void search_add(struct search *s, size_t pos)
+{
+	if(s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 64;
+		s->found = realloc(s->found, s->cap * sizeof *s->found);
+	}
+	s->found[s->n++] = pos;
+	s->next = pos + s->len;
+}
+
+// adds the matches in [data, end), which is at pos, returning true when done
+static bool search_range(struct search *s, const char *data, const char *end,
+						size_t pos)
+{
+	const char *m = data;
+	if(s->next > pos)
+		m += MIN(s->next - pos, (size_t)(end - data));
+	for(; (m = mem_find(m, end, s->needle, s->len)); m += s->len) {
+		search_add(s, pos + (m - data));
+		if(!s->all)
+			return true;
+	}
+	return false;
+}
+
+// searches the n bytes of data at pos, after those searched so far
+static bool search_next(struct search *s, const char *data, size_t n,
+						size_t pos)
+{
+	size_t keep = s->len - 1, head = MIN(n, keep);
+	memcpy(s->buf + s->seam, data, head);
+	if(search_range(s, s->buf, s->buf + s->seam + head, pos - s->seam) ||
+			search_range(s, data, data + n, pos))
+		return true;
+	if(n >= keep)
+		memcpy(s->buf, data + n - keep, keep);
+	else if(s->seam + n > keep)
+		memmove(s->buf, s->buf + s->seam + n - keep, keep);
+	s->seam = MIN(s->seam + n, keep);
+	return false;
+}
+
+// searches the n bytes of data at pos, before those searched so far, for the
+// last match
+static bool search_prev(struct search *s, const char *data, size_t n,
+						size_t pos)
+{
+	size_t keep = s->len - 1, tail = MIN(n, keep);
+	memmove(s->buf + tail, s->buf, s->seam);
+	memcpy(s->buf, data + n - tail, tail);
+	const char *m = mem_rfind(s->buf, s->buf + tail + s->seam, s->needle,
+							s->len);
+	if(m)
+		search_add(s, pos + n - tail + (m - s->buf));
+	else if((m = mem_rfind(data, data + n, s->needle, s->len)))
+		search_add(s, pos + (m - data));
+	else {
+		if(n >= keep)
+			memcpy(s->buf, data, keep);
+		s->seam = MIN(tail + s->seam, keep);
+	}
+	return m != NULL;
+}
+
+bool st_find(const SliceTable *st, size_t pos, const char *needle, size_t len,
+			size_t *found)
+{
+	if(pos > st_size(st) || len > st_size(st) - pos)
+		return false;
+	if(len == 0) {
+		*found = pos;
+		return true;
+	}
+	struct search s;
+	search_init(&s, needle, len, false);
+	SliceIter *it = st_iter_new((SliceTable *)st, pos);
+	while(!search_next(&s, it->data, it->span - it->off, it->pos) &&
+			st_iter_next_chunk(it))
+		;
+	st_iter_free(it);
+	if(s.n)
+		*found = s.found[0];
+	free(s.found);
+	free(s.buf);
+	return s.n;
+}
+
+bool st_rfind(const SliceTable *st, size_t pos, const char *needle,
+			size_t len, size_t *found)
+{
+	if(pos > st_size(st) || len > pos)
+		return false;
+	if(len == 0) {
+		*found = pos;
+		return true;
+	}
+	struct search s;
+	search_init(&s, needle, len, false);
+	SliceIter *it = st_iter_new((SliceTable *)st, pos);
+	// only the part of the first slice before pos
+	size_t n = it->off;
+	while(!search_prev(&s, it->data - it->off, n, it->pos - it->off) &&
+			it->pos != it->off) {
+		st_iter_prev_chunk(it);
+		n = it->span;
+	}
+	st_iter_free(it);
+	if(s.n)
+		*found = s.found[0];
+	free(s.found);
+	free(s.buf);
+	return s.n;
+}
+
+size_t st_find_all(const SliceTable *st, const char *needle, size_t len,
+				size_t **found)
+{
+	*found = NULL;
+	if(len == 0 || len > st_size(st))
+		return 0;
+	struct search s;
+	search_init(&s, needle, len, true);
+	SliceIter *it = st_iter_new((SliceTable *)st, 0);
+	do
+		search_next(&s, it->data, it->span - it->off, it->pos);
+	while(st_iter_next_chunk(it));
+	st_iter_free(it);
+	free(s.buf);
+	*found = s.found;
+	return s.n;
 }
 
 /* debugging */
@@ -1240,14 +4039,16 @@ void st_print_struct_sizes(void)
 	printf(
 		"Implementation: \e[38;5;1mpersistent btree\e[0m with B=%u\n"
 		"sizeof(struct node): %zd\n"
-		"sizeof(PieceTable): %zd\n",
-		B, sizeof(struct node), sizeof(SliceTable)
+		"sizeof(PieceTable): %zd\n"
+		"HIGH_WATER: %d\n",
+		B, sizeof(struct node), sizeof(SliceTable), HIGH_WATER
 	);
 }
 
 static void print_node(const struct node *node, int level)
 {
-	char out[256], *it = out;
+	// a slot takes at most a colour escape, 20 digits and a bar
+	char out[B * 32 + 8], *it = out;
 
 	it += sprintf(it, "[");
 	if(level == 1) {
@@ -1273,6 +4074,18 @@ static void print_node(const struct node *node, int level)
 static bool check_recurse(struct node *root, int height, int level)
 {
 	int fill = node_fill(root, 0);
+	if(root->fill != fill) {
+		st_dbg("stale fill %d of ", root->fill);
+		print_node(root, level);
+		return false;
+	}
+	size_t end = 0;
+	for(int i = 0; i < B; i++)
+		if(root->ends[i] != (i < fill ? (end += root->spans[i]) : ULONG_MAX)) {
+			st_dbg("stale end in slot %d of ", i);
+			print_node(root, level);
+			return false;
+		}
 	if(level == 1) {
 		bool fillcheck = (height == 1) || fill >= B/2 + (B&1);
 		if(!fillcheck) {
@@ -1290,6 +4103,12 @@ static bool check_recurse(struct node *root, int height, int level)
 				return false;
 			}
 			size = span;
+			struct metrics m = measure(root->child[i], span);
+			if(memcmp(&m, &root->metrics[i], sizeof m)) {
+				st_dbg("metrics violation in slot %d of ", i);
+				print_node(root, 1);
+				return false;
+			}
 			if(lastsize + size <= HIGH_WATER) {
 				st_dbg("adjacent slice size violation in slot %d of ", i);
 				print_node(root, 1);
@@ -1326,14 +4145,229 @@ static bool check_recurse(struct node *root, int height, int level)
 				st_dbg("with child sum: %zd span %zd\n",spansum,root->spans[i]);
 				return false;
 			}
+			struct metrics m = child_metrics(root, i);
+			if(memcmp(&m, &root->metrics[i], sizeof m)) {
+				st_dbg("child metrics violation in slot %d of ", i);
+				print_node(root, 2);
+				return false;
+			}
 		}
 		return true;
 	}
 }
 
+// marks in order, with links and priorities that agree, and within size. prev
+// is the position of the last mark seen, and 1 if it has right gravity
+static bool check_marks(const struct slicemark *t, size_t base, size_t size,
+						size_t prev[2])
+{
+	if(!t)
+		return true;
+	size_t pos = base + t->off;
+	size_t right = t->flags & ST_MARK_RIGHT ? 1 : 0;
+	for(int i = 0; i < 2; i++) {
+		const struct slicemark *child = i ? t->right : t->left;
+		if(child && (child->parent != t || child->prio > t->prio)) {
+			st_dbg("mark link or priority violation at %zu\n", pos);
+			return false;
+		}
+	}
+	if(!t->live || !check_marks(t->left, pos, size, prev))
+		return false;
+	if(pos > size || pos < prev[0] || pos == prev[0] && right < prev[1]) {
+		st_dbg("mark order violation at %zu after %zu\n", pos, prev[0]);
+		return false;
+	}
+	prev[0] = pos;
+	prev[1] = right;
+	return check_marks(t->right, pos, size, prev);
+}
+
 bool st_check_invariants(const SliceTable *st)
 {
-	return check_recurse(st->root, st->levels, st->levels);
+	size_t prev[2] = { 0, 0 };
+	return check_recurse(st->root, st->levels, st->levels) &&
+		(!st->marks || !st->marks->parent) &&
+		check_marks(st->marks, 0, st_size(st), prev);
+}
+
+/* saving */
+
+// calls fn on each slice in order, stopping when it returns false
+static bool walk_slices(const struct node *root, int level,
+		bool (*fn)(const char *data, size_t len, void *ctx), void *ctx)
+{
+	for(int i = 0; i < node_fill(root, 0); i++)
+		if(!(level > 1 ? walk_slices(root->child[i], level - 1, fn, ctx)
+					: fn(root->child[i], root->spans[i], ctx)))
+			return false;
+	return true;
+}
+
+#define IOV_BATCH 128
+
+struct writer {
+	int fd;
+	// slices not yet written, in order
+	struct iovec iov[IOV_BATCH];
+	int iovcnt;
+	// mapped windows that ranges can be copied from by the kernel
+	const struct block **files;
+	int nfiles, cap;
+	bool kernel_copy; // cleared when it isn't supported for fd
+	// range of files[file] not yet written, after the iovecs
+	int file;
+	off_t off;
+	size_t len;
+};
+
+static void add_file(const struct block *block, void *ctx)
+{
+	struct writer *w = ctx;
+	if(block->type != MMAP)
+		return;
+	if(w->nfiles == w->cap) {
+		w->cap = w->cap ? 2 * w->cap : 16;
+		w->files = realloc(w->files, w->cap * sizeof *w->files);
+	}
+	w->files[w->nfiles++] = block;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t n = write(fd, data, len);
+		if(n < 0 && errno != EINTR)
+			return false;
+		if(n > 0)
+			data += n, len -= n;
+	}
+	return true;
+}
+
+static bool flush_iov(struct writer *w)
+{
+	struct iovec *iov = w->iov;
+	int count = w->iovcnt;
+	w->iovcnt = 0;
+	while(count > 0) {
+		ssize_t n = writev(w->fd, iov, count);
+		if(n < 0 && errno != EINTR)
+			return false;
+		// skip what was written, which may end partway through an iovec
+		for(; count > 0 && n >= (ssize_t)iov->iov_len; iov++, count--)
+			n -= iov->iov_len;
+		if(count > 0 && n > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+static bool flush_range(struct writer *w)
+{
+	const struct block *file = w->files[w->file];
+	off_t off = w->off;
+	size_t len = w->len;
+	w->len = 0;
+#ifdef __linux__
+	while(len > 0 && w->kernel_copy) {
+		ssize_t n = copy_file_range(file->fd, &off, w->fd, NULL, len, 0);
+		if(n <= 0) // not between these files, try sendfile
+			n = sendfile(w->fd, file->fd, &off, len);
+		if(n <= 0)
+			w->kernel_copy = false;
+		else
+			len -= n;
+	}
+#endif
+	// write whatever is left from the mapping
+	return write_all(w->fd, file->data + (off - file->offset), len);
+}
+
+static bool write_slice(const char *data, size_t len, void *ctx)
+{
+	struct writer *w = ctx;
+	// small ranges aren't worth a syscall of their own
+	int f = w->nfiles;
+	if(len >= LOW_WATER && w->kernel_copy) {
+		// slices mostly follow on from the last one
+		f = w->file;
+		if(!within_block(w->files[f], data))
+			for(f = 0; f < w->nfiles; f++)
+				if(within_block(w->files[f], data))
+					break;
+	}
+	if(f < w->nfiles) {
+		const struct block *file = w->files[f];
+		off_t off = file->offset + (data - file->data);
+		if(w->len > 0 && w->file == f && w->off + (off_t)w->len == off) {
+			w->len += len;
+			return true;
+		}
+		if(!flush_iov(w) || w->len > 0 && !flush_range(w))
+			return false;
+		w->file = f;
+		w->off = off;
+		w->len = len;
+		return true;
+	}
+	if(w->len > 0 && !flush_range(w))
+		return false;
+	w->iov[w->iovcnt++] = (struct iovec){ (char *)data, len };
+	return w->iovcnt < IOV_BATCH || flush_iov(w);
+}
+
+bool st_write_fd(const SliceTable *st, int fd)
+{
+	struct writer w = { .fd = fd };
+	walk_blocks(st->blocks, add_file, &w);
+	w.kernel_copy = w.nfiles > 0;
+	bool ok = walk_slices(st->root, st->levels, write_slice, &w) &&
+		flush_iov(&w) && (w.len == 0 || flush_range(&w));
+	free(w.files);
+	return ok;
+}
+
+bool st_save(const SliceTable *st, const char *path)
+{
+	// write a temporary file next to path and rename it over path, so that
+	// path is never left half written and tables mapping it are unaffected
+	size_t len = strlen(path);
+	char *tmp = malloc(len + sizeof ".XXXXXX");
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".XXXXXX", sizeof ".XXXXXX");
+	int fd = mkstemp(tmp);
+	if(fd < 0) {
+		free(tmp);
+		return false;
+	}
+	// mkstemp creates files only the user can read
+	struct stat sb;
+	if(stat(path, &sb) == 0)
+		fchmod(fd, sb.st_mode & 07777);
+	else {
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+	bool ok = st_write_fd(st, fd) && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok && rename(tmp, path) == 0;
+	if(!ok)
+		unlink(tmp);
+	free(tmp);
+	return ok;
+}
+
+static bool dump_slice(const char *data, size_t len, void *file)
+{
+	return fwrite(data, 1, len, file) == len;
+}
+
+void st_dump(const SliceTable *st, FILE *file)
+{
+	walk_slices(st->root, st->levels, dump_slice, file);
 }
 
 /* global queue */
@@ -1373,20 +4407,6 @@ void st_pprint(const SliceTable *st)
 	puts("");
 }
 
-void st_dump(const SliceTable *st, FILE *file)
-{
-	enqueue((struct q){ st->levels, st->root });
-	struct q *next;
-	while((next = dequeue()))
-		if(next->level > 1)
-			for(int i = 0; i < node_fill(next->node, 0); i++)
-				enqueue((struct q){ next->level-1, next->node->child[i] });
-		else // start dumping
-			for(int i = 0; i < node_fill(next->node, 0); i++)
-				fprintf(file, "%.*s", (int)next->node->spans[i], // TODO write
-						(char *)next->node->child[i]);
-}
-
 /* dot output */
 
 #include "dot.h"
@@ -1,48 +1,488 @@
+/*
+ * fuzzing harness: each line of input is an edit or a query, checked against
+ * a flat copy of the text. Under AFL the lines come from stdin, otherwise
+ * fuzz <seed> <lines> makes them up
+ */
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE // mkstemp
+#endif
+
+#undef NDEBUG // the asserts are the checks
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "st.h"
 
-int main(void)
+// the text as it should be
+struct text {
+	char *data;
+	size_t len;
+};
+
+// marks as they should be
+struct mark {
+	SliceMark *mark;
+	size_t pos;
+	int flags;
+	bool live;
+};
+
+#define MARKS 16
+// versions kept for undo before the history is started over
+#define VERSIONS 64
+
+static struct text text;
+static struct text undo[VERSIONS], redo[VERSIONS];
+static int nundo, nredo;
+static struct mark marks[MARKS];
+static int nmarks;
+static bool transient;
+static char path[] = "/tmp/fuzz.XXXXXX";
+
+static struct text text_copy(const char *data, size_t len)
 {
-	SliceTable *st = st_new();
-	st_insert(st, 0, "x", 1);
-#ifdef AFL_DEBUG
-	FILE *sm = fopen("tests/case", "r");
-	//FILE *sm = fopen("mini", "r");
-#else
-	FILE *sm = stdin;
-#endif
-	char line[10000], *s;
-	while(true) {
-		s = fgets(line, 10000, sm);
-		if(!s)
-			break;
+	struct text t = { malloc(len + 1), len };
+	memcpy(t.data, data, len);
+	return t;
+}
 
-		size_t linelen = strlen(s);
-		if(linelen < 4)
+// the model of move_marks
+static void move_marks(size_t pos, size_t del, size_t len, bool detach)
+{
+	for(int k = 0; k < nmarks; k++) {
+		struct mark *m = &marks[k];
+		if(!m->live || m->pos < pos)
 			continue;
+		if(del == 0) {
+			if(m->pos > pos || m->flags & ST_MARK_RIGHT)
+				m->pos += len;
+		} else if(m->pos > pos + del)
+			m->pos += len - del;
+		else if(detach && m->flags & ST_MARK_DETACH && m->pos > pos &&
+				m->pos < pos + del) {
+			m->live = false;
+			m->pos = pos;
+		} else
+			m->pos = m->flags & ST_MARK_RIGHT ? pos + len : pos;
+	}
+}
+
+// undo and redo only keep marks within the text
+static void clamp_marks(void)
+{
+	for(int k = 0; k < nmarks; k++)
+		if(marks[k].live)
+			marks[k].pos = MIN(marks[k].pos, text.len);
+}
+
+// keeps the text for undo, as every edit is a group of its own
+static void record(void)
+{
+	while(nredo > 0)
+		free(redo[--nredo].data);
+	undo[nundo++] = text_copy(text.data, text.len);
+}
+
+static void replace(size_t pos, size_t del, const char *data, size_t len)
+{
+	text.data = realloc(text.data, text.len + len + 1);
+	memmove(text.data + pos + len, text.data + pos + del,
+			text.len - pos - del);
+	memcpy(text.data + pos, data, len);
+	text.len += len - del;
+}
+
+static void insert(SliceTable *st, size_t pos, const char *data, size_t len)
+{
+	if(len == 0)
+		return;
+	record();
+	move_marks(pos, 0, len, true);
+	replace(pos, 0, data, len);
+	st_insert(st, pos, data, len);
+}
+
+static void delete(SliceTable *st, size_t pos, size_t len)
+{
+	if(len == 0)
+		return;
+	record();
+	move_marks(pos, len, 0, true);
+	replace(pos, len, "", 0);
+	st_delete(st, pos, len);
+}
+
+// compares st with data, walking it by chunks
+static void check_text(SliceTable *st, const char *data, size_t len)
+{
+	assert(st_check_invariants(st));
+	assert(st_size(st) == len);
+	size_t newlines = 0;
+	for(size_t i = 0; i < len; i++)
+		newlines += data[i] == '\n';
+	assert(st_newlines(st) == newlines);
+	size_t cps = 0, line = newlines / 2, start = 0;
+	for(size_t i = 0, n = 0; i < len; i++) {
+		cps += ((unsigned char)data[i] & 0xc0) != 0x80;
+		if(data[i] == '\n' && ++n == line)
+			start = i + 1;
+	}
+	assert(st_codepoints(st) == cps);
+	assert(st_line_to_pos(st, line) == start);
+	assert(st_pos_to_line(st, start) == line);
+	if(len == 0)
+		return;
+	SliceIter *it = st_iter_new(st, 0);
+	size_t pos = 0;
+	do {
+		size_t n;
+		char *chunk = st_iter_chunk(it, &n);
+		assert(st_iter_pos(it) == pos && pos + n <= len);
+		assert(!memcmp(chunk, data + pos, n));
+		pos += n;
+	} while(st_iter_next_chunk(it));
+	assert(pos == len);
+	st_iter_free(it);
+}
+
+static void check(SliceTable *st)
+{
+	check_text(st, text.data, text.len);
+	for(int k = 0; k < nmarks; k++) {
+		assert(st_mark_live(marks[k].mark) == marks[k].live);
+		assert(st_mark_pos(marks[k].mark) == marks[k].pos);
+	}
+}
+
+// byte k of data, or 0 past its end
+static unsigned arg(const char *data, size_t len, size_t k)
+{
+	return k < len ? (unsigned char)data[k] : 0;
+}
+
+// split at pos, and put the halves back together both ways round
+static void split_concat(SliceTable *st, size_t pos)
+{
+	SliceTable *left, *right;
+	st_persist(st);
+	bool ok = st_split(st, pos, &left, &right);
+	assert(ok);
+	check_text(left, text.data, pos);
+	check_text(right, text.data + pos, text.len - pos);
+	SliceTable *whole = st_concat(left, right);
+	check_text(whole, text.data, text.len);
+	SliceTable *rotated = st_concat(right, left);
+	struct text t = text_copy(text.data + pos, text.len - pos);
+	t.data = realloc(t.data, text.len + 1);
+	memcpy(t.data + t.len, text.data, pos);
+	check_text(rotated, t.data, text.len);
+	free(t.data);
+	st_free(left);
+	st_free(right);
+	st_free(whole);
+	st_free(rotated);
+	if(transient)
+		st_transient(st);
+}
+
+static void batch(SliceTable *st, size_t pos, const char *data, size_t len)
+{
+	SliceEdit edits[4];
+	size_t n = 1 + arg(data, len, 0) % 4, at = 0;
+	for(size_t k = 0; k < n; k++) {
+		size_t gap = arg(data, len, 1 + 2*k) % (text.len - at + 1);
+		size_t del = arg(data, len, 2 + 2*k) % 8;
+		edits[k].pos = k == 0 ? MIN(pos, text.len) : at + gap;
+		edits[k].del = MIN(del, text.len - edits[k].pos);
+		edits[k].data = data;
+		edits[k].len = k < len ? len - k : 0;
+		at = edits[k].pos + edits[k].del;
+	}
+	record();
+	for(size_t k = n; k-- > 0;)
+		move_marks(edits[k].pos, edits[k].del, edits[k].len, true);
+	for(size_t k = n; k-- > 0;)
+		replace(edits[k].pos, edits[k].del, edits[k].data, edits[k].len);
+	st_apply_batch(st, edits, n);
+}
+
+static void insert_from(SliceTable *st, size_t pos, const char *data,
+						size_t len)
+{
+	size_t from = (arg(data, len, 0) << 8 | arg(data, len, 1)) %
+		(text.len + 1);
+	size_t n = (arg(data, len, 2) << 8 | arg(data, len, 3)) %
+		(text.len - from + 1);
+	struct text before = text_copy(text.data, text.len);
+	SliceTable *src = st;
+	if(arg(data, len, 4) & 1) { // or a clone, which is left alone
+		st_persist(st);
+		src = st_clone(st);
+		if(transient)
+			st_transient(st);
+	}
+	if(n > 0) {
+		record();
+		move_marks(pos, 0, n, true);
+		replace(pos, 0, before.data + from, n);
+	}
+	bool ok = st_insert_from(st, pos, src, from, n);
+	assert(ok);
+	if(src != st) {
+		check_text(src, before.data, before.len);
+		st_free(src);
+	}
+	free(before.data);
+}
+
+static void history(SliceTable *st, bool back)
+{
+	struct text *from = back ? undo : redo, *to = back ? redo : undo;
+	int *nfrom = back ? &nundo : &nredo, *nto = back ? &nredo : &nundo;
+	bool ok = back ? st_undo(st) : st_redo(st);
+	assert(ok == (*nfrom > 0));
+	if(*nfrom == 0)
+		return;
+	to[(*nto)++] = text;
+	text = from[--*nfrom];
+	clamp_marks();
+}
+
+static void free_versions(void)
+{
+	while(nundo > 0)
+		free(undo[--nundo].data);
+	while(nredo > 0)
+		free(redo[--nredo].data);
+}
+
+static void reset_history(SliceTable *st)
+{
+	st_set_history(st, 0);
+	st_set_history(st, SIZE_MAX);
+	free_versions();
+}
+
+static void find(SliceTable *st, size_t pos, const char *data, size_t len)
+{
+	// look for text that is there as often as not
+	size_t n = 1 + arg(data, len, 0) % 4;
+	const char *needle = data + 1;
+	if(arg(data, len, 1) & 1 && pos + n <= text.len)
+		needle = text.data + pos;
+	else if(len < n + 1)
+		return;
+	size_t at = (arg(data, len, 2) << 8 | arg(data, len, 3)) % (text.len + 1);
+	size_t found, expect;
+	for(expect = at; expect + n <= text.len; expect++)
+		if(!memcmp(text.data + expect, needle, n))
+			break;
+	bool ok = expect + n <= text.len;
+	assert(st_find(st, at, needle, n, &found) == ok);
+	assert(!ok || found == expect);
+	for(expect = at; expect-- > 0;)
+		if(expect + n <= at && !memcmp(text.data + expect, needle, n))
+			break;
+	ok = expect != SIZE_MAX;
+	assert(st_rfind(st, at, needle, n, &found) == ok);
+	assert(!ok || found == expect);
+
+	size_t *all, count = st_find_all(st, needle, n, &all), k = 0;
+	for(size_t i = 0; i + n <= text.len; i++)
+		if(!memcmp(text.data + i, needle, n)) {
+			assert(k < count && all[k++] == i);
+			i += n - 1;
+		}
+	assert(k == count);
+	free(all);
+}
+
+static void mark(SliceTable *st, size_t pos, const char *data, size_t len)
+{
+	unsigned op = arg(data, len, 0);
+	if(nmarks == 0 || nmarks < MARKS && op % 3 == 0) {
+		int flags = arg(data, len, 1) % 4;
+		marks[nmarks] = (struct mark){
+			st_mark_new(st, pos, flags), pos, flags, true
+		};
+		assert(marks[nmarks].mark);
+		nmarks++;
+		return;
+	}
+	struct mark *m = &marks[op % nmarks];
+	if(op % 3 == 1) {
+		bool ok = st_mark_set(st, m->mark, pos);
+		assert(ok);
+		m->pos = pos;
+		m->live = true;
+	} else {
+		st_mark_free(st, m->mark);
+		*m = marks[--nmarks];
+	}
+}
 
-		linelen -= 2;
-		bool op = *s++ % 2;
-		unsigned i = *s++;
-		unsigned j = *s++;
+// an edit between placing an iterator and refreshing it, then a seek
+static void iterate(SliceTable *st, size_t pos, const char *data, size_t len)
+{
+	size_t at = (arg(data, len, 0) << 8 | arg(data, len, 1)) %
+		(text.len + 1);
+	SliceIter *it = st_iter_new(st, at);
+	if(arg(data, len, 2) & 1) {
+		insert(st, pos, data, len);
+		if(at >= pos)
+			at += len;
+	} else {
+		size_t n = MIN(len, text.len - pos);
+		delete(st, pos, n);
+		if(at >= pos + n)
+			at -= n;
+		else if(at > pos)
+			at = pos;
+	}
+	st_iter_refresh(it);
+	assert(st_iter_pos(it) == at);
+	assert(at == text.len || st_iter_byte(it) == text.data[at]);
 
-		i = 1000*i + j;
-		size_t pos = st_size(st) - (i % st_size(st) + i%2);
+	size_t to = (arg(data, len, 3) << 8 | arg(data, len, 4)) %
+		(text.len + 1);
+	st_iter_seek_rel(it, (long)to - (long)at);
+	assert(st_iter_pos(it) == to);
+	if(to < text.len) {
+		assert(st_iter_byte(it) == text.data[to]);
+		// chunks are whole slices, so look at the path from the next one
+		size_t n;
+		char *chunk;
+		if(st_iter_next_chunk(it)) {
+			chunk = st_iter_chunk(it, &n);
+			assert(!memcmp(chunk, text.data + st_iter_pos(it), n));
+		}
+		if(st_iter_prev_chunk(it)) {
+			chunk = st_iter_chunk(it, &n);
+			size_t start = st_iter_pos(it) + 1 - n;
+			assert(start <= to && !memcmp(chunk, text.data + start, n));
+		}
+	}
+	st_iter_free(it);
+}
 
-		if(op)
-			st_insert(st, pos, s, linelen);
+static void save(SliceTable *st, bool fd)
+{
+	SliceTable *loaded;
+	if(fd) {
+		FILE *file = tmpfile();
+		bool ok = st_write_fd(st, fileno(file));
+		assert(ok);
+		char *buf = malloc(text.len + 1);
+		rewind(file);
+		size_t n = fread(buf, 1, text.len + 1, file);
+		assert(n == text.len);
+		assert(!memcmp(buf, text.data, text.len));
+		free(buf);
+		fclose(file);
+		return;
+	}
+	bool ok = st_save(st, path);
+	assert(ok);
+	loaded = st_new_from_file(path);
+	assert(loaded);
+	check_text(loaded, text.data, text.len);
+	st_free(loaded);
+}
+
+// s holds the op, two bytes for the position, then the data
+static void step(SliceTable *st, const char *s, size_t len)
+{
+	int op = (unsigned char)*s++ % 12;
+	unsigned i = (unsigned char)*s++;
+	unsigned j = (unsigned char)*s++;
+	len -= 3;
+
+	i = 1000*i + j;
+	size_t pos = st_size(st) - (i % st_size(st) + i%2);
+
+	if(nundo >= VERSIONS - 2) // a step records up to two
+		reset_history(st);
+	switch(op) {
+	case 0: delete(st, pos, len % st_size(st) % (st_size(st) - pos + 1));
+		break;
+	case 1: insert(st, pos, s, len); break;
+	case 2: { // ranges spanning many leaves
+		unsigned k = 1000*arg(s, len, 0) + arg(s, len, 1);
+		delete(st, pos, k % (st_size(st) - pos + 1));
+		break;
+	}
+	case 3: find(st, pos, s, len); break;
+	case 4: batch(st, pos, s, len); break;
+	case 5: split_concat(st, pos); break;
+	case 6: insert_from(st, pos, s, len); break;
+	case 7: save(st, arg(s, len, 0) & 1); break;
+	case 8: history(st, arg(s, len, 0) & 1); break;
+	case 9:
+		if((transient = !transient))
+			st_transient(st);
 		else
-			st_delete(st, pos, linelen % st_size(st));
+			st_persist(st);
+		break;
+	case 10: iterate(st, pos, s, len); break;
+	case 11: mark(st, pos, s, len); break;
+	}
+	if(st_size(st) == 0) // the positions above need some text
+		insert(st, 0, "x", 1);
+	st_commit(st);
 #ifdef AFL_DEBUG
-		st_pprint(st);
+	st_pprint(st);
 #endif
-		assert(st_check_invariants(st));
-	}
+	check(st);
+}
+
+// a line of ops, with text mostly short but now and then over a leaf
+static size_t make_line(char *line, size_t size)
+{
+	static const char alphabet[] = "abc\nde\xc3\xa9";
+	size_t len = 3 + (rand() % 16 ? rand() % 64 : rand() % 4000);
+	// keep the text around 64KiB, deep enough for long range deletes
+	line[0] = rand() % 2 ? rand() : size < 1<<16 ? 1 : 2;
+	for(size_t k = 1; k < len; k++)
+		line[k] = k < 8 ? rand() : alphabet[rand() % 8];
+	return len;
+}
+
+int main(int argc, char **argv)
+{
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	SliceTable *st = st_new();
+	st_set_history(st, SIZE_MAX);
+	text = text_copy("", 0);
+	insert(st, 0, "x", 1);
+	st_commit(st);
+	char line[10000];
+	if(argc > 2) {
+		srand(atoi(argv[1]));
+		for(long n = atol(argv[2]); n > 0; n--)
+			step(st, line, make_line(line, st_size(st)));
+	} else {
+#ifdef AFL_DEBUG
+		FILE *sm = fopen("tests/case", "r");
+#else
+		FILE *sm = stdin;
+#endif
+		while(fgets(line, sizeof line, sm)) {
+			size_t linelen = strlen(line);
+			if(linelen >= 4)
+				step(st, line, linelen);
+		}
 #ifdef AFL_DEBUG
-	fclose(sm);
+		fclose(sm);
 #endif
+	}
 	st_free(st);
+	free_versions();
+	free(text.data);
+	unlink(path);
 }
@@ -5,7 +5,6 @@
 
 #include "st.h"
 
-// TODO use ropey's batch replacement approach
 int main(int argc, char **argv)
 {
 #if 1
@@ -34,46 +33,27 @@ int main(int argc, char **argv)
 			(after.tv_sec - before.tv_sec) * 1000);
 
 	SliceTable *clone = st_clone(st);
-	SliceIter *it = st_iter_new(st, 0);
-	size_t i = 0;
-	char c;
-	bool *matchpos = calloc(len, sizeof(bool));
-	int matches = 0;
 
 	clock_gettime(CLOCK_REALTIME, &before);
-	// a basic search, comparable to ropey's search_and_replace.rs
-	while((c = st_iter_next_byte(it, 1)) != -1) {
-		for(int m = len - 2; m >= 0; m--) {
-			if(matchpos[m]) { // already matched at i
-				if(c == pattern[m+1]) {
-					matchpos[m+1] = matchpos[m];
-				}
-				matchpos[m] = 0;
-			}
-		}
-		// try matching latest character
-		if(c == pattern[0]) {
-			matchpos[0] = i;
-		}
-		if(matchpos[len-1]) { // fully matched!
-			st_delete(st, i - len+2, len);
-			st_insert(st, i - len+2, replace, replacelen);
-			st_iter_to(it, i+1);
-			matchpos[len-1] = 0;
-			matches++;
-		}
-		i++;
-	}
+	size_t *found;
+	size_t matches = st_find_all(st, pattern, len, &found);
+	SliceEdit *edits = malloc(matches * sizeof *edits);
+	for(size_t i = 0; i < matches; i++)
+		edits[i] = (SliceEdit){
+			.pos = found[i], .del = len, .data = replace, .len = replacelen
+		};
+	// replace all matches in one pass, as in ropey's batch replacement
+	st_apply_batch(st, edits, matches);
 	clock_gettime(CLOCK_REALTIME, &after);
 	st_pprint(st);
-	fprintf(stderr, "found/replaced %d matches in %f ms, "
+	fprintf(stderr, "found/replaced %zu matches in %f ms, "
 			"leaves: %zd, size %zd, depth %d\n",
 			matches,
 			(after.tv_nsec - before.tv_nsec) / 1000000.0f +
 			(after.tv_sec - before.tv_sec) * 1000,
 			st_node_count(st), st_size(st), st_depth(st));
-	free(matchpos);
-	st_iter_free(it);
+	free(found);
+	free(edits);
 	st_free(clone);
 	st_free(st);
 #else
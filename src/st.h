@@ -15,6 +15,14 @@
 
 typedef struct slicetable SliceTable;
 typedef struct sliceiter SliceIter;
+typedef struct slicepublisher SlicePublisher;
+
+// replaces the del bytes at pos with len bytes of data
+typedef struct sliceedit {
+	size_t pos, del;
+	const char *data;
+	size_t len;
+} SliceEdit;
 
 /* API
  * in general the caller must check that pos <= st_size(st)
@@ -22,13 +30,98 @@ typedef struct sliceiter SliceIter;
 
 SliceTable *st_new(void);
 SliceTable *st_new_from_file(const char *path);
+// these copy data into a new table, building it on up to threads threads, or
+// one per cpu if threads is 0
+SliceTable *st_new_from_buffer(const char *data, size_t len, int threads);
+SliceTable *st_new_from_chunks(const char *const *chunks, const size_t *lens,
+							size_t n, int threads);
 void st_free(SliceTable *st);
+// drops the pages of files mapped by st from memory, to be read back in when
+// next needed. For use under memory pressure
+void st_release_pages(const SliceTable *st);
+// must be called on the thread editing st, see st_publish for other threads
 SliceTable *st_clone(const SliceTable *st);
+// these return new tables sharing structure with their arguments, which are
+// left as they are
+bool st_split(const SliceTable *st, size_t pos,
+			SliceTable **left, SliceTable **right);
+SliceTable *st_concat(const SliceTable *a, const SliceTable *b);
 
 size_t st_size(const SliceTable *st);
+// number of '\n' bytes in st, i.e. the number of lines less one
+size_t st_newlines(const SliceTable *st);
+// line numbers are 0-based: line n starts after the nth '\n'
+// the caller must check that line <= st_newlines(st)
+size_t st_line_to_pos(const SliceTable *st, size_t line);
+size_t st_pos_to_line(const SliceTable *st, size_t pos);
+// codepoints are counted as utf-8 leading bytes, whether valid or not
+size_t st_codepoints(const SliceTable *st);
+// the caller must check that cp <= st_codepoints(st)
+size_t st_cp_to_byte(const SliceTable *st, size_t cp);
+size_t st_byte_to_cp(const SliceTable *st, size_t pos);
 
 bool st_insert(SliceTable *st, size_t pos, const char *data, size_t len);
 bool st_delete(SliceTable *st, size_t pos, size_t len);
+// inserts len bytes of src at srcpos, sharing its slices rather than copying
+// them. src may be dst, and may only be transient if it is
+bool st_insert_from(SliceTable *dst, size_t pos,
+					const SliceTable *src, size_t srcpos, size_t len);
+// applies all edits in a single pass. They must be sorted by position and
+// may not overlap, with positions referring to the document before any edits
+bool st_apply_batch(SliceTable *st, const SliceEdit *edits, size_t n);
+
+/* transient editing
+ * between st_transient and st_persist, nodes created or copied by edits are
+ * owned by st and edited in place after that, without checking whether they
+ * are shared. st may not be cloned, split, concatenated or published until it
+ * is persisted again. Undo and redo work as before
+ */
+
+void st_transient(SliceTable *st);
+void st_persist(SliceTable *st);
+
+// writes the contents to fd, copying from the mapped file in the kernel where
+// possible. fd may not be the file st was loaded from, use st_save for that
+bool st_write_fd(const SliceTable *st, int fd);
+// replaces the file at path atomically, st may have been loaded from it
+bool st_save(const SliceTable *st, const char *path);
+
+/* history
+ * with a history, each edit keeps the version before it for undo, except that
+ * small edits continuing the last one, as in typing, are grouped with it
+ */
+
+// keeps versions up to roughly budget bytes, dropping the oldest first. A
+// budget of 0 drops the history
+void st_set_history(SliceTable *st, size_t budget);
+// ends the current group, e.g. when the cursor moves
+void st_commit(SliceTable *st);
+// these return false if there is nothing to undo or redo. Editing drops the
+// versions left to redo
+bool st_undo(SliceTable *st);
+bool st_redo(SliceTable *st);
+
+/* marks
+ * positions that move with edits to their table, such as cursors, bookmarks
+ * or diagnostics. Text inserted at a mark goes after it, or before it with
+ * ST_MARK_RIGHT. Marks within deleted text move to where it was, or are
+ * detached with ST_MARK_DETACH, keeping that position from then on. Undo and
+ * redo don't know what changed, so they only move marks past the end back to
+ * it. Edits take O(log n) in the number of marks, plus the marks at or within
+ * deleted text. Marks are freed with their table
+ */
+
+typedef struct slicemark SliceMark;
+enum { ST_MARK_RIGHT = 1, ST_MARK_DETACH = 2 };
+
+// returns NULL if pos is past the end
+SliceMark *st_mark_new(SliceTable *st, size_t pos, int flags);
+void st_mark_free(SliceTable *st, SliceMark *mark);
+size_t st_mark_pos(const SliceMark *mark);
+// false once the mark has been detached
+bool st_mark_live(const SliceMark *mark);
+// moves the mark to pos, attaching it again if it was detached
+bool st_mark_set(SliceTable *st, SliceMark *mark, size_t pos);
 
 bool st_check_invariants(const SliceTable *st);
 void st_pprint(const SliceTable *st);
@@ -38,15 +131,71 @@ bool st_to_dot(const SliceTable *st, const char *path);
 int st_depth(const SliceTable *st);
 size_t st_node_count(const SliceTable *st);
 
+/* snapshots
+ * a writer thread publishes versions of a table, which reader threads take
+ * snapshots of. Snapshots never change and edits on the writer take no locks
+ */
+
+SlicePublisher *st_publisher_new(void);
+// there may be no readers left
+void st_publisher_free(SlicePublisher *pub);
+// makes the current version of st the one that readers get
+void st_publish(SlicePublisher *pub, const SliceTable *st);
+// returns the last published version, or NULL if there is none. It stays
+// valid after later versions are published, until it is released
+SliceTable *st_snapshot_acquire(SlicePublisher *pub);
+void st_snapshot_release(SliceTable *snapshot);
+
+/* parallel traversal
+ * these split st into ranges of about equal size, and call fn on the slices
+ * in each range in order, with their position in st. Slices may be cut at
+ * range boundaries. Ranges are walked on up to threads threads, or one per
+ * cpu if threads is 0. st must not be edited meanwhile, so take a snapshot
+ * if other threads edit it
+ */
+
+void st_parallel_for_chunks(const SliceTable *st, int threads,
+		void (*fn)(const char *data, size_t len, size_t pos, void *ctx),
+		void *ctx);
+// fn accumulates into acc, a copy of the size bytes at result made for each
+// range. These are then merged back into result in order
+void st_parallel_reduce(const SliceTable *st, int threads,
+		void (*fn)(const char *data, size_t len, size_t pos, void *acc),
+		void (*merge)(void *result, const void *acc),
+		void *result, size_t size);
+
+/* search */
+
+// these look for the len bytes of needle, returning false if there are none.
+// st_find finds the first occurrence starting at or after pos, st_rfind the
+// last ending at or before pos
+bool st_find(const SliceTable *st, size_t pos, const char *needle, size_t len,
+			size_t *found);
+bool st_rfind(const SliceTable *st, size_t pos, const char *needle,
+			size_t len, size_t *found);
+// returns the number of occurrences that don't overlap those found before
+// them, and their positions in *found, which the caller frees
+size_t st_find_all(const SliceTable *st, const char *needle, size_t len,
+				size_t **found);
+
 /* read-only iterator */
 
 // it is an error to call any of st_iter_* except st_iter_free after the
-// SliceTable instance has been freed or modified
+// SliceTable instance has been freed, or after it has been modified until the
+// iterator is refreshed or moved with st_iter_to. Debug builds check this
 
 SliceIter *st_iter_new(SliceTable *st, size_t pos);
 void st_iter_free(SliceIter *it);
 // reinitializes the iterator
 SliceIter *st_iter_to(SliceIter *it, size_t pos);
+// the same as st_iter_to(it, st_iter_pos(it) + delta), but cheaper the closer
+// the new position is
+SliceIter *st_iter_seek_rel(SliceIter *it, long delta);
+// brings the iterator up to date after an insert or delete, keeping it on the
+// same byte, or where that byte was if it was deleted. If that edit left its
+// leaf alone, this doesn't search the tree. After other or several edits it
+// is moved to the same position, or the end if that is past it
+SliceIter *st_iter_refresh(SliceIter *it);
 
 SliceTable *st_iter_st(const SliceIter *it);
 size_t st_iter_pos(const SliceIter *it);
@@ -59,10 +208,15 @@ char st_iter_byte(const SliceIter *it);
 char st_iter_next_byte(SliceIter *it, size_t count);
 char st_iter_prev_byte(SliceIter *it, size_t count);
 
+// these return -1 at the end of the document or for invalid utf-8. The
+// iterator is left at position 0 when moving back past the start
 long st_iter_cp(const SliceIter *it);
 long st_iter_next_cp(SliceIter *it, size_t count);
 long st_iter_prev_cp(SliceIter *it, size_t count);
 
+// these move to the start of a line, returning false and stopping at the end
+// (start) of the document if there are less than count lines after (before)
+// the current one
 bool st_iter_next_line(SliceIter *it, size_t count);
 bool st_iter_prev_line(SliceIter *it, size_t count);
 